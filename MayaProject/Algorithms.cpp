@@ -1,29 +1,436 @@
 #include "Algorithms.h"
+#include "Kernels.h"
+#include "BufferPool.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <limits.h>
 #include "ipp.h"
+#include <ppl.h>
+#include <atomic>
+#include <vector>
 
 using namespace std;
+using namespace concurrency;
 
 #define max(a,b)    (((a) > (b)) ? (a) : (b))
 #define min(a,b)    (((a) < (b)) ? (a) : (b))
 
-bool CalculateMeanStd(const unsigned char* Input,unsigned int InputByteStep,
-					  const unsigned char* Mask,unsigned int MaskByteStep,
-					  unsigned int Width,unsigned int Height,
-					  double& Mean,double& Std);
+// Number of histogram bins used by the 16 bit Otsu threshold
+const unsigned int OtsuHistogramBins=1024;
 
-bool CalculateLines(const unsigned char* InputImage,unsigned int Width,unsigned int Height,unsigned int ByteStep,
-					double& Result,unsigned char*& ResultImage,int& ResultByteStep) {
+// Gray level constants are given for 8 bit images and scaled to the full range of T
+template <class T> inline double GrayLevelScale() { return 1.0; }
+template <> inline double GrayLevelScale<unsigned short>() { return (double)USHRT_MAX/(double)UCHAR_MAX; }
+
+// Pixel type overloads of the IPP kernels used by the algorithms
+inline IppStatus MeanStdDev(const Ipp8u* Image,int ByteStep,IppiSize Roi,double* Mean,double* Std) {
+	return ippiMean_StdDev_8u_C1R(Image,ByteStep,Roi,Mean,Std);
+}
+inline IppStatus MeanStdDev(const Ipp16u* Image,int ByteStep,IppiSize Roi,double* Mean,double* Std) {
+	return ippiMean_StdDev_16u_C1R(Image,ByteStep,Roi,Mean,Std);
+}
+inline IppStatus MinValue(const Ipp8u* Image,int ByteStep,IppiSize Roi,Ipp8u* Min) {
+	return ippiMin_8u_C1R(Image,ByteStep,Roi,Min);
+}
+inline IppStatus MinValue(const Ipp16u* Image,int ByteStep,IppiSize Roi,Ipp16u* Min) {
+	return ippiMin_16u_C1R(Image,ByteStep,Roi,Min);
+}
+inline IppStatus MaxValue(const Ipp8u* Image,int ByteStep,IppiSize Roi,Ipp8u* Max) {
+	return ippiMax_8u_C1R(Image,ByteStep,Roi,Max);
+}
+inline IppStatus MaxValue(const Ipp16u* Image,int ByteStep,IppiSize Roi,Ipp16u* Max) {
+	return ippiMax_16u_C1R(Image,ByteStep,Roi,Max);
+}
+inline IppStatus ComputeOtsuThreshold(const Ipp8u* Image,int ByteStep,IppiSize Roi,Ipp8u* Threshold) {
+	return ippiComputeThreshold_Otsu_8u_C1R(Image,ByteStep,Roi,Threshold);
+}
+IppStatus ComputeOtsuThreshold(const Ipp16u* Image,int ByteStep,IppiSize Roi,Ipp16u* Threshold);
+
+// Set pixels at or above threshold to 255, pixels below keep a value other than 255
+inline IppStatus ThresholdUpper(const Ipp8u* Image,int ByteStep,Ipp8u* Result,int ResultByteStep,IppiSize Roi,Ipp8u Threshold) {
+	return ippiThreshold_GTVal_8u_C1R(Image,ByteStep,Result,ResultByteStep,Roi,Threshold-1,255);
+}
+inline IppStatus ThresholdUpper(const Ipp16u* Image,int ByteStep,Ipp8u* Result,int ResultByteStep,IppiSize Roi,Ipp16u Threshold) {
+	return ippiCompareC_16u_C1R(Image,ByteStep,Threshold,Result,ResultByteStep,Roi,ippCmpGreaterEq);
+}
+
+// Set pixels at or above threshold to 255 and pixels below to 0
+inline IppStatus ThresholdBinary(const Ipp8u* Image,int ByteStep,Ipp8u* Result,int ResultByteStep,IppiSize Roi,Ipp8u Threshold) {
+	IppStatus Status=ippiThreshold_LTVal_8u_C1R(Image,ByteStep,Result,ResultByteStep,Roi,Threshold,0);
+	if(Status != ippStsNoErr)
+		return Status;
+	return ippiThreshold_GTVal_8u_C1IR(Result,ResultByteStep,Roi,Threshold-1,255);
+}
+inline IppStatus ThresholdBinary(const Ipp16u* Image,int ByteStep,Ipp8u* Result,int ResultByteStep,IppiSize Roi,Ipp16u Threshold) {
+	return ippiCompareC_16u_C1R(Image,ByteStep,Threshold,Result,ResultByteStep,Roi,ippCmpGreaterEq);
+}
+
+// Write the transpose of the Roi sized image
+inline IppStatus Transpose(const Ipp8u* Image,int ByteStep,Ipp8u* Result,int ResultByteStep,IppiSize Roi) {
+	return ippiTranspose_8u_C1R(Image,ByteStep,Result,ResultByteStep,Roi);
+}
+inline IppStatus Transpose(const Ipp16u* Image,int ByteStep,Ipp16u* Result,int ResultByteStep,IppiSize Roi) {
+	return ippiTranspose_16u_C1R(Image,ByteStep,Result,ResultByteStep,Roi);
+}
+
+// Classify lines bins on a level downsampled by Factor. Empty and uniform bins get their final mask,
+// threshold and statistics here, bins with structure are left as BinFull for full resolution analysis
+template <class T> bool ClassifyLinesBins(const T* InputImage,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+										  unsigned int BinSize,unsigned int Factor,bool Parallel,
+										  unsigned char* ResultImage,int ResultByteStep,
+										  T* OtsuThreshold,double* MeanBuffer,double* StdBuffer,unsigned char* BinClasses) {
+
+	const double MinMeanGL=10.0*GrayLevelScale<T>();
+	const double MinStdGL=5.0*GrayLevelScale<T>();
+
+	// Calculate number of bins
+	unsigned int NumberOfBinsX=(Width+BinSize-1)/BinSize;
+	unsigned int NumberOfBinsY=(Height+BinSize-1)/BinSize;
+
+	// Calculate size of downsampled level
+	unsigned int CoarseWidth=Width/Factor;
+	unsigned int CoarseHeight=Height/Factor;
+	unsigned int CoarseByteStep=CoarseWidth*sizeof(T);
+	unsigned int CoarseExpansion=LinesRoiExpansion/Factor;
+	if(!CoarseWidth || !CoarseHeight)
+		return true;
+
+	// Allocate downsampled levels of block means, minima and maxima
+	T* CoarseImage=(T*)ippsMalloc_8u(3*CoarseHeight*CoarseByteStep);
+	if(!CoarseImage) {
+		printf("ClassifyLinesBins failed while trying to allocate downsampled image buffer\n");
+		return false;
+	}
+	T* CoarseMinImage=(T*)((unsigned char*)CoarseImage+CoarseHeight*CoarseByteStep);
+	T* CoarseMaxImage=(T*)((unsigned char*)CoarseImage+2*CoarseHeight*CoarseByteStep);
+
+	// Each downsampled pixel is the rounded mean of a Factor x Factor block. The block extrema keep the full
+	// resolution range of each bin, so thin lines averaged away by the mean still mark their bin as structured
+	auto DownsampleRow=[&](unsigned int Cnt1) {
+		T* CoarseLine=(T*)((unsigned char*)CoarseImage+Cnt1*CoarseByteStep);
+		T* CoarseMinLine=(T*)((unsigned char*)CoarseMinImage+Cnt1*CoarseByteStep);
+		T* CoarseMaxLine=(T*)((unsigned char*)CoarseMaxImage+Cnt1*CoarseByteStep);
+		for(unsigned int Cnt2=0;Cnt2<CoarseWidth;Cnt2++) {
+			unsigned int Sum=0;
+			T BlockMin=*PixelAt(InputImage,ByteStep,Cnt2*Factor,Cnt1*Factor),BlockMax=BlockMin;
+			for(unsigned int Cnt3=0;Cnt3<Factor;Cnt3++) {
+				const T* Pixel=PixelAt(InputImage,ByteStep,Cnt2*Factor,Cnt1*Factor+Cnt3);
+				for(unsigned int Cnt4=0;Cnt4<Factor;Cnt4++) {
+					Sum+=Pixel[Cnt4];
+					BlockMin=min(BlockMin,Pixel[Cnt4]);
+					BlockMax=max(BlockMax,Pixel[Cnt4]);
+				}
+			}
+			CoarseLine[Cnt2]=(T)((Sum+Factor*Factor/2)/(Factor*Factor));
+			CoarseMinLine[Cnt2]=BlockMin;
+			CoarseMaxLine[Cnt2]=BlockMax;
+		}
+	};
+	if(Parallel)
+		parallel_for(0u,CoarseHeight,DownsampleRow);
+	else
+		for(unsigned int Cnt1=0;Cnt1<CoarseHeight;Cnt1++)
+			DownsampleRow(Cnt1);
+
+	// Darkest level of the image, background out of tissue sits close to it
+	IppiSize CoarseRoi={(int)CoarseWidth,(int)CoarseHeight};
+	T ImageMinGL=0;
+	MinValue(CoarseMinImage,CoarseByteStep,CoarseRoi,&ImageMinGL);
+
+	auto ClassifyRow=[&](unsigned int Cnt1) {
+		for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++) {
+
+			// Bins outside the ROI are already settled
+			unsigned int Index=Cnt1*NumberOfBinsX+Cnt2;
+			if(BinClasses[Index] != BinFull)
+				continue;
+
+			// Bins reaching past the downsampled level are analysed at full resolution
+			unsigned int BinEndX=min(Width,(Cnt2+1)*BinSize);
+			unsigned int BinEndY=min(Height,(Cnt1+1)*BinSize);
+			if((BinEndX > CoarseWidth*Factor) || (BinEndY > CoarseHeight*Factor))
+				continue;
+
+			// Calculate bin statistics on the downsampled level, the range is that of the full resolution bin
+			IppiSize Roi={(int)((BinEndX-Cnt2*BinSize)/Factor),(int)((BinEndY-Cnt1*BinSize)/Factor)};
+			unsigned int StartIndexX=Cnt2*BinSize/Factor;
+			unsigned int StartIndexY=Cnt1*BinSize/Factor;
+			double Mean=0.0,Std=0.0;
+			T MinGL=0,MaxGL=0;
+			MeanStdDev(PixelAt(CoarseImage,CoarseByteStep,StartIndexX,StartIndexY),CoarseByteStep,Roi,&Mean,&Std);
+			MinValue(PixelAt(CoarseMinImage,CoarseByteStep,StartIndexX,StartIndexY),CoarseByteStep,Roi,&MinGL);
+			MaxValue(PixelAt(CoarseMaxImage,CoarseByteStep,StartIndexX,StartIndexY),CoarseByteStep,Roi,&MaxGL);
+
+			// Bins with any structure need full resolution
+			if((double)MaxGL-(double)MinGL >= MinStdGL)
+				continue;
+
+			unsigned char Value=0;
+			T Threshold=MaxGL;
+			if((double)MaxGL < (double)ImageMinGL+MinMeanGL) {
+				BinClasses[Index]=BinEmpty;
+			}
+			else {
+
+				// Threshold the flat bin as the first pass would, with the ROI expanded on the downsampled level
+				double ExpandedMean=Mean,ExpandedStd=Std;
+				IppiSize ExpandedRoi=Roi;
+				while((ExpandedMean < (MinGL+MinMeanGL))&&(ExpandedStd < MinStdGL)) {
+					if((ExpandedRoi.width >= (int)CoarseWidth) && (ExpandedRoi.height >= (int)CoarseHeight)) {
+						break;
+					}
+					StartIndexX=max(0,(int)StartIndexX-(int)CoarseExpansion);
+					StartIndexY=max(0,(int)StartIndexY-(int)CoarseExpansion);
+					ExpandedRoi.width=min(CoarseWidth,StartIndexX+ExpandedRoi.width+2*CoarseExpansion)-StartIndexX;
+					ExpandedRoi.height=min(CoarseHeight,StartIndexY+ExpandedRoi.height+2*CoarseExpansion)-StartIndexY;
+					MeanStdDev(PixelAt(CoarseImage,CoarseByteStep,StartIndexX,StartIndexY),CoarseByteStep,ExpandedRoi,&ExpandedMean,&ExpandedStd);
+				}
+				ComputeOtsuThreshold(PixelAt(CoarseImage,CoarseByteStep,StartIndexX,StartIndexY),CoarseByteStep,ExpandedRoi,&Threshold);
+				Value=(Mean >= (double)Threshold) ? 255 : 0;
+				BinClasses[Index]=BinUniform;
+			}
+
+			// Set the bin's final results
+			OtsuThreshold[Index]=Threshold;
+			MeanBuffer[Index]=Mean;
+			StdBuffer[Index]=Std;
+			IppiSize BinRoi={(int)(BinEndX-Cnt2*BinSize),(int)(BinEndY-Cnt1*BinSize)};
+			ippiSet_8u_C1R(Value,ResultImage+Cnt1*BinSize*ResultByteStep+Cnt2*BinSize,ResultByteStep,BinRoi);
+		}
+	};
+	if(Parallel)
+		parallel_for(0u,NumberOfBinsY,ClassifyRow);
+	else
+		for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++)
+			ClassifyRow(Cnt1);
+
+	// Free memory
+	ippsFree(CoarseImage);
+
+	return true;
+}
+
+// Running minimum (IsMax false) or maximum over windows of 2R+1 rows, for Width contiguous columns in place.
+// Windows are clipped to the image. Following van Herk and Gil-Werman, rows are split into blocks of 2R+1
+// with prefix and suffix extrema inside each block, and each window is the extremum of one suffix and one
+// prefix, so the cost per pixel does not depend on R. All operations combine whole rows, the inner loops run
+// over contiguous columns and vectorize. Prefix and Suffix hold PaddedHeight rows of Width, Identity one row
+template <class T,bool IsMax> void RunningExtremumRows(T* Image,unsigned int ByteStep,unsigned int Width,unsigned int Height,unsigned int R,
+													   T* Prefix,T* Suffix,const T* Identity) {
+
+	// Padded row P is image row P-R, rows outside the image hold the identity
+	const unsigned int BlockSize=2*R+1;
+	const unsigned int PaddedHeight=(Height+2*R+BlockSize-1)/BlockSize*BlockSize;
+	auto PaddedRow=[&](unsigned int Cnt1) -> const T* {
+		return ((Cnt1 < R) || (Cnt1 >= Height+R)) ? Identity : PixelAt((const T*)Image,ByteStep,0,Cnt1-R);
+	};
+
+	// Prefix and suffix extrema of each block
+	for(unsigned int Cnt1=0;Cnt1<PaddedHeight;Cnt1+=BlockSize) {
+		memcpy(Prefix+Cnt1*Width,PaddedRow(Cnt1),Width*sizeof(T));
+		for(unsigned int Cnt2=Cnt1+1;Cnt2<Cnt1+BlockSize;Cnt2++) {
+			const T* Row=PaddedRow(Cnt2);
+			const T* Previous=Prefix+(Cnt2-1)*Width;
+			T* Current=Prefix+Cnt2*Width;
+			for(unsigned int Cnt3=0;Cnt3<Width;Cnt3++)
+				Current[Cnt3]=IsMax ? max(Previous[Cnt3],Row[Cnt3]) : min(Previous[Cnt3],Row[Cnt3]);
+		}
+		memcpy(Suffix+(Cnt1+BlockSize-1)*Width,PaddedRow(Cnt1+BlockSize-1),Width*sizeof(T));
+		for(unsigned int Cnt2=Cnt1+BlockSize-1;Cnt2>Cnt1;Cnt2--) {
+			const T* Row=PaddedRow(Cnt2-1);
+			const T* Next=Suffix+Cnt2*Width;
+			T* Current=Suffix+(Cnt2-1)*Width;
+			for(unsigned int Cnt3=0;Cnt3<Width;Cnt3++)
+				Current[Cnt3]=IsMax ? max(Next[Cnt3],Row[Cnt3]) : min(Next[Cnt3],Row[Cnt3]);
+		}
+	}
+
+	// The window of image row Cnt1 spans padded rows Cnt1 to Cnt1+2R
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		const T* First=Suffix+Cnt1*Width;
+		const T* Last=Prefix+(Cnt1+2*R)*Width;
+		T* ImageLine=(T*)PixelAt((const T*)Image,ByteStep,0,Cnt1);
+		for(unsigned int Cnt2=0;Cnt2<Width;Cnt2++)
+			ImageLine[Cnt2]=IsMax ? max(First[Cnt2],Last[Cnt2]) : min(First[Cnt2],Last[Cnt2]);
+	}
+}
+
+// Scratch buffers of one thread of the background filter, kept for all strips the thread processes. They come
+// from the buffer pool, so the following images of the same size reuse them
+template <class T> struct BackgroundBuffers {
+	BackgroundBuffers() : Band(NULL), Prefix(NULL), Suffix(NULL) {}
+	T* Band;
+	T* Prefix;
+	T* Suffix;
+	vector<T> Identity;
+};
+
+// Running extremum over a (2R+1)x(2R+1) square of Source into Image, as running extrema along rows and then
+// along columns. Source may be Image. Columns are processed in strips of BackgroundStripWidth, rows by
+// transposing bands of that many rows, which is where Source is read
+template <class T,bool IsMax> void RunningExtremum(const T* Source,unsigned int SourceByteStep,T* Image,unsigned int ByteStep,
+												   unsigned int Width,unsigned int Height,unsigned int R,bool Parallel,
+												   combinable<BackgroundBuffers<T> >& Pools,atomic<bool>& IsBufferFailed) {
+
+	const unsigned int BlockSize=2*R+1;
+	const T IdentityGL=IsMax ? 0 : (T)~(T)0;
+	auto GetBuffers=[&]() -> BackgroundBuffers<T>* {
+		BackgroundBuffers<T>& Buffers=Pools.local();
+		if(!Buffers.Band) {
+			unsigned int PaddedLength=(max(Width,Height)+2*R+BlockSize-1)/BlockSize*BlockSize;
+			int BufferByteStep=0;
+			Buffers.Band=(T*)PoolMalloc_8u_C1(Width*BackgroundStripWidth*sizeof(T),1,&BufferByteStep);
+			Buffers.Prefix=(T*)PoolMalloc_8u_C1(PaddedLength*BackgroundStripWidth*sizeof(T),1,&BufferByteStep);
+			Buffers.Suffix=(T*)PoolMalloc_8u_C1(PaddedLength*BackgroundStripWidth*sizeof(T),1,&BufferByteStep);
+		}
+		if(!(Buffers.Band && Buffers.Prefix && Buffers.Suffix)) {
+			IsBufferFailed=true;
+			return NULL;
+		}
+		Buffers.Identity.assign(BackgroundStripWidth,IdentityGL);
+		return &Buffers;
+	};
+
+	// Along rows, each band of rows is transposed so its rows become contiguous columns
+	auto FilterBand=[&](unsigned int Cnt1) {
+		BackgroundBuffers<T>* Buffers=GetBuffers();
+		if(!Buffers)
+			return;
+		unsigned int StartIndexY=Cnt1*BackgroundStripWidth;
+		IppiSize Roi={(int)Width,(int)(min(Height,StartIndexY+BackgroundStripWidth)-StartIndexY)};
+		unsigned int BandByteStep=Roi.height*sizeof(T);
+		Transpose(PixelAt(Source,SourceByteStep,0,StartIndexY),SourceByteStep,Buffers->Band,BandByteStep,Roi);
+		RunningExtremumRows<T,IsMax>(Buffers->Band,BandByteStep,Roi.height,Width,R,Buffers->Prefix,Buffers->Suffix,&Buffers->Identity[0]);
+		IppiSize TransposedRoi={Roi.height,Roi.width};
+		Transpose(Buffers->Band,BandByteStep,(T*)PixelAt((const T*)Image,ByteStep,0,StartIndexY),ByteStep,TransposedRoi);
+	};
+
+	// Along columns, strips are filtered where they are
+	auto FilterStrip=[&](unsigned int Cnt1) {
+		BackgroundBuffers<T>* Buffers=GetBuffers();
+		if(!Buffers)
+			return;
+		unsigned int StartIndexX=Cnt1*BackgroundStripWidth;
+		unsigned int StripWidth=min(Width,StartIndexX+BackgroundStripWidth)-StartIndexX;
+		RunningExtremumRows<T,IsMax>((T*)PixelAt((const T*)Image,ByteStep,StartIndexX,0),ByteStep,StripWidth,Height,R,
+									 Buffers->Prefix,Buffers->Suffix,&Buffers->Identity[0]);
+	};
+
+	unsigned int NumberOfBands=(Height+BackgroundStripWidth-1)/BackgroundStripWidth;
+	unsigned int NumberOfStrips=(Width+BackgroundStripWidth-1)/BackgroundStripWidth;
+	if(Parallel) {
+		parallel_for(0u,NumberOfBands,FilterBand);
+		parallel_for(0u,NumberOfStrips,FilterStrip);
+	}
+	else {
+		for(unsigned int Cnt1=0;Cnt1<NumberOfBands;Cnt1++)
+			FilterBand(Cnt1);
+		for(unsigned int Cnt1=0;Cnt1<NumberOfStrips;Cnt1++)
+			FilterStrip(Cnt1);
+	}
+}
+
+template <class T> bool SubtractBackground(const T* InputImage,unsigned int Width,unsigned int Height,unsigned int ByteStep,unsigned int Radius,
+										   bool Parallel,T*& ResultImage,int& ResultByteStep,const RoiMask* Roi) {
+
+	// Check inputs
+	if(!(InputImage && Width && Height && Radius)) {
+		printf("Inputs to background subtraction are incorrect\n");
+		return false;
+	}
+
+	// Allocate result buffer from the pool, the background is estimated in it
+	ResultImage=(T*)PoolMalloc_8u_C1(Width*sizeof(T),Height,&ResultByteStep);
+	if(!ResultImage) {
+		printf("SubtractBackground failed while trying to allocate result image buffer\n");
+		return false;
+	}
+
+	// With a ROI only its bounding rows and the 2R rows the opening reaches beyond them are processed, which
+	// gives the same result on the ROI rows as the whole image. Rows further away are set to zero
+	if(Roi && ((Roi->GetWidth() != Width) || (Roi->GetHeight() != Height))) {
+		printf("SubtractBackground failed, ROI size %ux%u does not match image size %ux%u\n",Roi->GetWidth(),Roi->GetHeight(),Width,Height);
+		PoolFree(ResultImage);
+		ResultImage=NULL;
+		return false;
+	}
+	unsigned int FirstRow=0,EndRow=Height;
+	if(Roi) {
+		FirstRow=Height;
+		EndRow=0;
+		for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+			if(!Roi->IsRowEmpty(Cnt1)) {
+				FirstRow=min(FirstRow,Cnt1);
+				EndRow=Cnt1+1;
+			}
+		}
+		if(FirstRow < EndRow) {
+			FirstRow=(FirstRow > 2*Radius) ? FirstRow-2*Radius : 0;
+			EndRow=min(Height,EndRow+2*Radius);
+		}
+		else {
+			FirstRow=EndRow=Height;
+		}
+		for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+			if((Cnt1 < FirstRow) || (Cnt1 >= EndRow))
+				memset((T*)PixelAt((const T*)ResultImage,ResultByteStep,0,Cnt1),0,Width*sizeof(T));
+		}
+		if(FirstRow == EndRow)
+			return true;
+	}
+	const T* BandInput=PixelAt(InputImage,ByteStep,0,FirstRow);
+	T* BandResult=(T*)PixelAt((const T*)ResultImage,ResultByteStep,0,FirstRow);
+
+	// Background is the opening, erosion then dilation. The first pass reads the input and writes the result,
+	// the others run in place in it, with scratch buffers per thread across all four passes
+	combinable<BackgroundBuffers<T> > Pools;
+	atomic<bool> IsBufferFailed(false);
+	RunningExtremum<T,false>(BandInput,ByteStep,BandResult,ResultByteStep,Width,EndRow-FirstRow,Radius,Parallel,Pools,IsBufferFailed);
+	if(!IsBufferFailed)
+		RunningExtremum<T,true>(BandResult,ResultByteStep,BandResult,ResultByteStep,Width,EndRow-FirstRow,Radius,Parallel,Pools,IsBufferFailed);
+	Pools.combine_each([](const BackgroundBuffers<T>& Buffers) {
+		PoolFree(Buffers.Band);
+		PoolFree(Buffers.Prefix);
+		PoolFree(Buffers.Suffix);
+	});
+	if(IsBufferFailed) {
+		printf("SubtractBackground failed while trying to allocate temporary buffers\n");
+		PoolFree(ResultImage);
+		ResultImage=NULL;
+		return false;
+	}
+
+	// Subtract background, the opening never exceeds the image
+	auto SubtractRow=[&](unsigned int Cnt1) {
+		const T* InputLine=PixelAt(InputImage,ByteStep,0,Cnt1);
+		T* ResultLine=(T*)PixelAt((const T*)ResultImage,ResultByteStep,0,Cnt1);
+		for(unsigned int Cnt2=0;Cnt2<Width;Cnt2++)
+			ResultLine[Cnt2]=InputLine[Cnt2]-ResultLine[Cnt2];
+	};
+	if(Parallel)
+		parallel_for(FirstRow,EndRow,SubtractRow);
+	else
+		for(unsigned int Cnt1=FirstRow;Cnt1<EndRow;Cnt1++)
+			SubtractRow(Cnt1);
+
+	return true;
+}
+
+// Lines for a bin size fixed at compile time, or given by Parameters when FixedBinSize is 0
+template <class T,unsigned int FixedBinSize> bool CalculateLinesBins(const T* InputImage,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+																	 double& Result,unsigned char*& ResultImage,int& ResultByteStep,const LinesParameters& Parameters) {
 	
 	IppStatus Status=ippStsNoErr;
 
-	const unsigned int BinSize=64;
-	const double MinMeanGL=10.0;
-	const double MinStdGL=5.0;
+	const unsigned int BinSize=FixedBinSize ? FixedBinSize : Parameters.BinSize;
+	if(!BinSize) {
+		printf("CalculateLines failed, bin size must be positive\n");
+		return false;
+	}
+	const double MinMeanGL=10.0*GrayLevelScale<T>();
+	const double MinStdGL=5.0*GrayLevelScale<T>();
 
 	// Calculate number of bins
 	unsigned int NumberOfBinsX=Width/BinSize;
@@ -33,94 +440,180 @@ bool CalculateLines(const unsigned char* InputImage,unsigned int Width,unsigned
 	if(Height%BinSize)
 		NumberOfBinsY++;
 
+	// Check ROI
+	const RoiMask* Roi=Parameters.Roi;
+	if(Roi && ((Roi->GetWidth() != Width) || (Roi->GetHeight() != Height))) {
+		printf("CalculateLines failed, ROI size %ux%u does not match image size %ux%u\n",Roi->GetWidth(),Roi->GetHeight(),Width,Height);
+		return false;
+	}
+
 	// Allocate result buffer
-	ResultImage=ippiMalloc_8u_C1(Width,Height,&ResultByteStep);
+	ResultImage=PoolMalloc_8u_C1(Width,Height,&ResultByteStep);
 	if(!ResultImage) {
 		printf("CalculateLines failed while trying to allocate result image buffer\n");
 		return false;
 	}
-	unsigned char* OtsuThreshold=ippsMalloc_8u(NumberOfBinsX*NumberOfBinsY);
+	T* OtsuThreshold=(T*)ippsMalloc_8u(NumberOfBinsX*NumberOfBinsY*sizeof(T));
 	if(!OtsuThreshold) {
 		printf("CalculateLines failed while trying to allocate Otsu threshold buffer\n");
-		ippiFree(ResultImage);
+		PoolFree(ResultImage);
 		return false;
 	}
 	double* StdBuffer=ippsMalloc_64f(NumberOfBinsX*NumberOfBinsY);
 	if(!StdBuffer) {
 		printf("CalculateLines failed while trying to allocate Std buffer\n");
-		ippiFree(ResultImage);
+		PoolFree(ResultImage);
 		ippsFree(OtsuThreshold);
 		return false;
 	}
 	double* MeanBuffer=ippsMalloc_64f(NumberOfBinsX*NumberOfBinsY);
 	if(!MeanBuffer) {
 		printf("CalculateLines failed while trying to allocate Std buffer\n");
-		ippiFree(ResultImage);
+		PoolFree(ResultImage);
 		ippsFree(OtsuThreshold);
 		ippsFree(StdBuffer);
 		return false;
 	}
-	unsigned char* OtsuBuffer=ippsMalloc_8u(3*BinSize*3*BinSize);
-	if(!OtsuBuffer) {
-		printf("CalculateLines failed while trying to allocate Otsu temporary buffer\n");
-		ippiFree(ResultImage);
+	unsigned char* BinClasses=ippsMalloc_8u(NumberOfBinsX*NumberOfBinsY);
+	if(!BinClasses) {
+		printf("CalculateLines failed while trying to allocate bin class buffer\n");
+		PoolFree(ResultImage);
 		ippsFree(OtsuThreshold);
 		ippsFree(StdBuffer);
 		ippsFree(MeanBuffer);
 		return false;
 	}
+
+	// Otsu temporary buffers are allocated by each thread on first use
+	combinable<T*> OtsuBuffers([]() -> T* { return NULL; });
+	atomic<bool> IsOtsuBufferFailed(false);
 	
-	// Set Results to zero
-	memset(ResultImage,0,Width*Height);
+	// Set Results to zero, padding included
+	memset(ResultImage,0,ResultByteStep*Height);
 
-	// Loop on all bins
-	IppiSize Roi={(int)Width,(int)Height};
-	for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++) {
-		for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++) {
-			
-			// Calculate indices to image
-			unsigned int StartIndexX=min(Width-1,Cnt2*BinSize);
-			unsigned int StartIndexY=min(Height-1,Cnt1*BinSize);
-			Roi.width = min(Width, (Cnt2 + 1)*BinSize) - StartIndexX;
-			Roi.height = min(Height, (Cnt1 + 1)*BinSize) - StartIndexY;
-
-			// Calculate bin std and mean
-			double Mean=0.0,Std=0.0;
-			unsigned char MinGL=UCHAR_MAX;
-			Status=ippiMean_StdDev_8u_C1R(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,Roi,&Mean,&Std);
-			Status=ippiMin_8u_C1R(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,Roi,&MinGL);
-			while((Mean < (MinGL+MinMeanGL))&&(Std < MinStdGL)) {
-				if((Roi.width >= Width) && (Roi.height >= Height)) {
-					break;
-				}
-				StartIndexX=max(0,(int)StartIndexX-64);
-				StartIndexY=max(0,(int)StartIndexY-64);
-				Roi.width=min(Width,StartIndexX+Roi.width+128)-StartIndexX;
-				Roi.height=min(Height,StartIndexY+Roi.height+128)-StartIndexY;
-				Status=ippiMean_StdDev_8u_C1R(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,Roi,&Mean,&Std);
+	// In pyramid mode empty and uniform bins are settled on a downsampled level, otherwise all bins are analysed
+	memset(BinClasses,BinFull,NumberOfBinsX*NumberOfBinsY);
+
+	// Bins without ROI pixels are skipped by all stages. Their mask is set to 255 so the masked statistics of
+	// neighbours with an expanded ROI leave them out, and cleared again with the rest of the outside pixels
+	if(Roi) {
+		for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++) {
+			for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++) {
+				unsigned int Index=Cnt1*NumberOfBinsX+Cnt2;
+				IppiSize BinRoi={(int)(min(Width,(Cnt2+1)*BinSize)-Cnt2*BinSize),(int)(min(Height,(Cnt1+1)*BinSize)-Cnt1*BinSize)};
+				if(Roi->GetAreaInRect(Cnt2*BinSize,Cnt1*BinSize,BinRoi.width,BinRoi.height))
+					continue;
+				ippiSet_8u_C1R(255,ResultImage+Cnt1*BinSize*ResultByteStep+Cnt2*BinSize,ResultByteStep,BinRoi);
+				BinClasses[Index]=BinOutside;
+				OtsuThreshold[Index]=0;
+				MeanBuffer[Index]=0.0;
+				StdBuffer[Index]=0.0;
 			}
-			
-			// Calculate image threshold
-			Status = ippiComputeThreshold_Otsu_8u_C1R(InputImage + StartIndexY*ByteStep + StartIndexX, ByteStep, Roi, OtsuThreshold + Cnt1*NumberOfBinsX + Cnt2);
-
-			// Reset ROI and indices in case they were changed
-			StartIndexX=min(Width-1,Cnt2*BinSize);
-			StartIndexY=min(Height-1,Cnt1*BinSize);
-			Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
-			Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
-
-			// Perform upper threshold
-			Status=ippiThreshold_GTVal_8u_C1R(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,
-											  ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-											  Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]-1,255);
-			
-			// Calculate Std of pixels below threshold
-			CalculateMeanStd(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,
-							 ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-							 Roi.width,Roi.height,
-							 MeanBuffer[Cnt1*NumberOfBinsX+Cnt2],StdBuffer[Cnt1*NumberOfBinsX+Cnt2]);
 		}
 	}
+	if((Parameters.PyramidFactor > 1) && !(BinSize%Parameters.PyramidFactor) &&
+	   !ClassifyLinesBins(InputImage,Width,Height,ByteStep,BinSize,Parameters.PyramidFactor,Parameters.Parallel,
+						  ResultImage,ResultByteStep,OtsuThreshold,MeanBuffer,StdBuffer,BinClasses)) {
+		PoolFree(ResultImage);
+		ResultImage=NULL;
+		ippsFree(OtsuThreshold);
+		ippsFree(StdBuffer);
+		ippsFree(MeanBuffer);
+		ippsFree(BinClasses);
+		return false;
+	}
+	if(Parameters.BinClassCounts) {
+		memset(Parameters.BinClassCounts,0,NumberOfBinClasses*sizeof(unsigned int));
+		for(unsigned int Cnt1=0;Cnt1<NumberOfBinsX*NumberOfBinsY;Cnt1++)
+			Parameters.BinClassCounts[BinClasses[Cnt1]]++;
+	}
+
+	// After background subtraction one threshold fits the whole image, so weak bins need no expanded ROI.
+	// With a ROI it is computed over the ROI pixels only, gathered into one row
+	T ImageThreshold=0;
+	if(Parameters.BackgroundCorrected && !Roi) {
+		IppiSize ImageRoi={(int)Width,(int)Height};
+		ComputeOtsuThreshold(InputImage,ByteStep,ImageRoi,&ImageThreshold);
+	}
+	else if(Parameters.BackgroundCorrected) {
+		vector<T> RoiPixels;
+		RoiPixels.reserve((size_t)Roi->GetArea());
+		for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+			const T* InputLine=PixelAt(InputImage,ByteStep,0,Cnt1);
+			const pair<unsigned int,unsigned int>* Spans=Roi->GetSpans(Cnt1);
+			for(unsigned int Cnt2=0;Cnt2<Roi->GetNumberOfSpans(Cnt1);Cnt2++)
+				RoiPixels.insert(RoiPixels.end(),InputLine+Spans[Cnt2].first,InputLine+Spans[Cnt2].second);
+		}
+		IppiSize PixelsRoi={(int)RoiPixels.size(),1};
+		if(!RoiPixels.empty())
+			ComputeOtsuThreshold(&RoiPixels[0],(int)(RoiPixels.size()*sizeof(T)),PixelsRoi,&ImageThreshold);
+	}
+
+	// Statistics of the pixels below threshold. With a fixed bin size interior bins and expanded ROIs have a
+	// width known at compile time, bins clipped by the image edge take the run time width
+	auto MaskedStatistics=[&](unsigned int StartIndexX,unsigned int StartIndexY,IppiSize Roi,double& Mean,double& Std) {
+		const T* Input=PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY);
+		const unsigned char* Mask=ResultImage+StartIndexY*ResultByteStep+StartIndexX;
+		if(!FixedBinSize)
+			CalculateMeanStd(Input,ByteStep,Mask,ResultByteStep,Roi.width,Roi.height,Mean,Std);
+		else if((unsigned int)Roi.width == BinSize)
+			MaskedMeanStd<T,FixedBinSize>(Input,ByteStep,Mask,ResultByteStep,Roi.width,Roi.height,Mean,Std);
+		else if((unsigned int)Roi.width == BinSize+2*LinesRoiExpansion)
+			MaskedMeanStd<T,FixedBinSize+2*LinesRoiExpansion>(Input,ByteStep,Mask,ResultByteStep,Roi.width,Roi.height,Mean,Std);
+		else
+			MaskedMeanStd<T,0>(Input,ByteStep,Mask,ResultByteStep,Roi.width,Roi.height,Mean,Std);
+	};
+
+	// First iteration, bins only touch their own part of the result image
+	auto FirstPass=[&](unsigned int Cnt1,unsigned int Cnt2) {
+
+		// Bins settled on the downsampled level are final
+		if(BinClasses[Cnt1*NumberOfBinsX+Cnt2] != BinFull)
+			return;
+
+		// Calculate indices to image
+		IppiSize Roi;
+		unsigned int StartIndexX=min(Width-1,Cnt2*BinSize);
+		unsigned int StartIndexY=min(Height-1,Cnt1*BinSize);
+		Roi.width = min(Width, (Cnt2 + 1)*BinSize) - StartIndexX;
+		Roi.height = min(Height, (Cnt1 + 1)*BinSize) - StartIndexY;
+
+		// Calculate bin std and mean
+		double Mean=0.0,Std=0.0;
+		T MinGL=0;
+		IppStatus Status=MeanStdDev(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,Roi,&Mean,&Std);
+		Status=MinValue(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,Roi,&MinGL);
+		while(!Parameters.BackgroundCorrected && (Mean < (MinGL+MinMeanGL))&&(Std < MinStdGL)) {
+			if((Roi.width >= Width) && (Roi.height >= Height)) {
+				break;
+			}
+			StartIndexX=max(0,(int)StartIndexX-(int)LinesRoiExpansion);
+			StartIndexY=max(0,(int)StartIndexY-(int)LinesRoiExpansion);
+			Roi.width=min(Width,StartIndexX+Roi.width+2*LinesRoiExpansion)-StartIndexX;
+			Roi.height=min(Height,StartIndexY+Roi.height+2*LinesRoiExpansion)-StartIndexY;
+			Status=MeanStdDev(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,Roi,&Mean,&Std);
+		}
+		
+		// Calculate image threshold, weak bins of a background corrected image take the image wide one
+		if(Parameters.BackgroundCorrected && (Mean < (MinGL+MinMeanGL))&&(Std < MinStdGL))
+			OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]=ImageThreshold;
+		else
+			Status = ComputeOtsuThreshold(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY), ByteStep, Roi, OtsuThreshold + Cnt1*NumberOfBinsX + Cnt2);
+
+		// Reset ROI and indices in case they were changed
+		StartIndexX=min(Width-1,Cnt2*BinSize);
+		StartIndexY=min(Height-1,Cnt1*BinSize);
+		Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
+		Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
+
+		// Perform upper threshold
+		Status=ThresholdUpper(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,
+							  ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
+							  Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]);
+		
+		// Calculate Std of pixels below threshold
+		MaskedStatistics(StartIndexX,StartIndexY,Roi,MeanBuffer[Cnt1*NumberOfBinsX+Cnt2],StdBuffer[Cnt1*NumberOfBinsX+Cnt2]);
+	};
 
 //	WritePgmFile<unsigned char>("D:\\Maya\\TestA.pgm",InputImage,Width,Height,ByteStep);
 //	WritePgmFile<unsigned char>("D:\\Maya\\TestB.pgm",ResultImage,Width,Height,ResultByteStep);
@@ -131,41 +624,63 @@ bool CalculateLines(const unsigned char* InputImage,unsigned int Width,unsigned
 //	Status=ippsMean_64f(StdBuffer,NumberOfBinsX*NumberOfBinsY,&MeanStd);
 //	MeanStd=max(MinStdGL,min(1.2*MinStd,MeanStd));
 	
-	// Second iteration loop
-	for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++) {
-		for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++) {
+	// Second iteration, bins with an expanded ROI read the masks of their neighbours
+	auto SecondPass=[&](unsigned int Cnt1,unsigned int Cnt2) {
 
-			// Calculate indices to image
-			unsigned int StartIndexX=min(Width-1,Cnt2*BinSize);
-			unsigned int StartIndexY=min(Height-1,Cnt1*BinSize);
-			Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
-			Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
-
-			// Calculate bin std and mean
-			if((MeanBuffer[Cnt1*NumberOfBinsX+Cnt2] < MinMeanGL)&&(StdBuffer[Cnt1*NumberOfBinsX+Cnt2] >= MinStdGL)) {
-				StartIndexX=max(0,(int)StartIndexX-64);
-				StartIndexY=max(0,(int)StartIndexY-64);
-				Roi.width=min(Width,StartIndexX+Roi.width+128)-StartIndexX;
-				Roi.height=min(Height,StartIndexY+Roi.height+128)-StartIndexY;
-				CalculateMeanStd(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,
-								 ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-								 Roi.width,Roi.height,
-								 MeanBuffer[Cnt1*NumberOfBinsX+Cnt2],StdBuffer[Cnt1*NumberOfBinsX+Cnt2]);
-			}
-			else if(StdBuffer[Cnt1*NumberOfBinsX+Cnt2] < MinStdGL) {
-				Status=ippiThreshold_LTVal_8u_C1R(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,
-												  ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-												  Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2],0);
-				Status=ippiThreshold_GTVal_8u_C1IR(ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-												   Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]-1,255);
-				continue;
-			}
-		
-			// Get pixels that didn't pass previous thresholding operation
-			const unsigned char* Pixel=0;
-			unsigned int NumberOfPixels=0;
+		// Bins settled on the downsampled level are final
+		if(BinClasses[Cnt1*NumberOfBinsX+Cnt2] != BinFull)
+			return;
+
+		// Calculate indices to image
+		IppiSize Roi;
+		unsigned int StartIndexX=min(Width-1,Cnt2*BinSize);
+		unsigned int StartIndexY=min(Height-1,Cnt1*BinSize);
+		Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
+		Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
+
+		// Calculate bin std and mean
+		IppStatus Status=ippStsNoErr;
+		if((MeanBuffer[Cnt1*NumberOfBinsX+Cnt2] < MinMeanGL)&&(StdBuffer[Cnt1*NumberOfBinsX+Cnt2] >= MinStdGL)) {
+			StartIndexX=max(0,(int)StartIndexX-(int)LinesRoiExpansion);
+			StartIndexY=max(0,(int)StartIndexY-(int)LinesRoiExpansion);
+			Roi.width=min(Width,StartIndexX+Roi.width+2*LinesRoiExpansion)-StartIndexX;
+			Roi.height=min(Height,StartIndexY+Roi.height+2*LinesRoiExpansion)-StartIndexY;
+			MaskedStatistics(StartIndexX,StartIndexY,Roi,MeanBuffer[Cnt1*NumberOfBinsX+Cnt2],StdBuffer[Cnt1*NumberOfBinsX+Cnt2]);
+		}
+		else if(StdBuffer[Cnt1*NumberOfBinsX+Cnt2] < MinStdGL) {
+			Status=ThresholdBinary(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,
+								   ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
+								   Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]);
+			return;
+		}
+
+		// Get this thread's Otsu buffer
+		T*& OtsuBuffer=OtsuBuffers.local();
+		if(!OtsuBuffer)
+			OtsuBuffer=(T*)ippsMalloc_8u((BinSize+2*LinesRoiExpansion)*(BinSize+2*LinesRoiExpansion)*sizeof(T));
+		if(!OtsuBuffer) {
+			IsOtsuBufferFailed=true;
+			return;
+		}
+	
+		// Get pixels that didn't pass previous thresholding operation
+		const T* Pixel=0;
+		unsigned int NumberOfPixels=0;
+		if(FixedBinSize && ((unsigned int)Roi.width == BinSize+2*LinesRoiExpansion)) {
+			NumberOfPixels=GatherBelowThreshold<T,FixedBinSize+2*LinesRoiExpansion>(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,
+																					Roi.width,Roi.height,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2],OtsuBuffer);
+		}
+		else if(FixedBinSize && ((unsigned int)Roi.width == BinSize)) {
+			NumberOfPixels=GatherBelowThreshold<T,FixedBinSize>(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,
+																Roi.width,Roi.height,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2],OtsuBuffer);
+		}
+		else if(FixedBinSize) {
+			NumberOfPixels=GatherBelowThreshold<T,0>(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,
+													 Roi.width,Roi.height,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2],OtsuBuffer);
+		}
+		else {
 			for(unsigned int Cnt3=0;Cnt3<(unsigned int)Roi.height;Cnt3++) {
-				Pixel=InputImage+(StartIndexY+Cnt3)*ByteStep+StartIndexX;
+				Pixel=PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY+Cnt3);
 				for(unsigned int Cnt4=0;Cnt4<(unsigned int)Roi.width;Cnt4++) {
 					if(Pixel[Cnt4] < OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]) {
 						OtsuBuffer[NumberOfPixels]=Pixel[Cnt4];
@@ -173,30 +688,80 @@ bool CalculateLines(const unsigned char* InputImage,unsigned int Width,unsigned
 					}					
 				}
 			}
+		}
 
-			// Calculate image threshold
-			Roi.width=NumberOfPixels;
-			Roi.height=1;
-			Status=ippiComputeThreshold_Otsu_8u_C1R(OtsuBuffer,NumberOfPixels,Roi,OtsuThreshold+Cnt1*NumberOfBinsX+Cnt2);
-			
-			// Reset ROI and indices in case they were changed
-			StartIndexX=min(Width-1,Cnt2*BinSize);
-			StartIndexY=min(Height-1,Cnt1*BinSize);
-			Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
-			Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
-			
-			// Perform threshold
-			Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
-			Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
-			Status=ippiThreshold_LTVal_8u_C1R(InputImage+StartIndexY*ByteStep+StartIndexX,ByteStep,
-											  ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-											  Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2],0);
-			Status=ippiThreshold_GTVal_8u_C1IR(ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
-											   Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]-1,255);
+		// Calculate image threshold
+		Roi.width=NumberOfPixels;
+		Roi.height=1;
+		Status=ComputeOtsuThreshold(OtsuBuffer,NumberOfPixels*sizeof(T),Roi,OtsuThreshold+Cnt1*NumberOfBinsX+Cnt2);
+		
+		// Reset ROI and indices in case they were changed
+		StartIndexX=min(Width-1,Cnt2*BinSize);
+		StartIndexY=min(Height-1,Cnt1*BinSize);
+		
+		// Perform threshold
+		Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
+		Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
+		Status=ThresholdBinary(PixelAt(InputImage,ByteStep,StartIndexX,StartIndexY),ByteStep,
+							   ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,
+							   Roi,OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2]);
+	};
+
+	if(Parameters.Parallel) {
+
+		// First iteration, one task per row of bins
+		parallel_for(0u,NumberOfBinsY,[&](unsigned int Cnt1) {
+			for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++)
+				FirstPass(Cnt1,Cnt2);
+		});
+
+		// Second iteration in waves. In serial order a bin sees its earlier neighbours already thresholded
+		// and its later ones not yet, so bin (X,Y) runs in wave X+WaveStep*Y, after its earlier neighbours
+		// within reach of the ROI expansion and together only with bins it does not touch
+		const unsigned int WaveStep=(LinesRoiExpansion+BinSize-1)/BinSize+1;
+		const unsigned int NumberOfWaves=NumberOfBinsY ? NumberOfBinsX+WaveStep*(NumberOfBinsY-1) : 0;
+		for(unsigned int Wave=0;Wave<NumberOfWaves;Wave++) {
+			unsigned int FirstRow=(Wave < NumberOfBinsX) ? 0 : (Wave-NumberOfBinsX)/WaveStep+1;
+			unsigned int LastRow=min(NumberOfBinsY-1,Wave/WaveStep);
+			parallel_for(FirstRow,LastRow+1,[&](unsigned int Cnt1) {
+				SecondPass(Cnt1,Wave-WaveStep*Cnt1);
+			});
 		}
 	}
+	else {
+
+		// Loop on all bins
+		for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++)
+			for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++)
+				FirstPass(Cnt1,Cnt2);
+
+		// Second iteration loop
+		for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++)
+			for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++)
+				SecondPass(Cnt1,Cnt2);
+	}
+
+	// Free Otsu buffers
+	OtsuBuffers.combine_each([](T* OtsuBuffer) {
+		if(OtsuBuffer)
+			ippsFree(OtsuBuffer);
+	});
+	if(IsOtsuBufferFailed) {
+		printf("CalculateLines failed while trying to allocate Otsu temporary buffer\n");
+		PoolFree(ResultImage);
+		ResultImage=NULL;
+		ippsFree(OtsuThreshold);
+		ippsFree(StdBuffer);
+		ippsFree(MeanBuffer);
+		ippsFree(BinClasses);
+		return false;
+	}
 
 //	WritePgmFile<unsigned char>("D:\\Maya\\TestC.pgm",ResultImage,Width,Height,ResultByteStep);
+
+	// Bins crossing the ROI border were thresholded whole
+	if(Roi)
+		Roi->Apply(ResultImage,ResultByteStep);
 	
 /*
 		// Set lines in image
@@ -210,13 +775,47 @@ bool CalculateLines(const unsigned char* InputImage,unsigned int Width,unsigned
 		}
 */
 
+	// Keep per bin statistics
+	if(Parameters.Grid) {
+		BinGrid& Grid=*Parameters.Grid;
+		Grid.Width=Width;
+		Grid.Height=Height;
+		Grid.BinSize=BinSize;
+		Grid.NumberOfBinsX=NumberOfBinsX;
+		Grid.NumberOfBinsY=NumberOfBinsY;
+		Grid.HasCircles=false;
+		Grid.Bins.assign(NumberOfBinsX*NumberOfBinsY,BinRecord());
+		auto FillGridRow=[&](unsigned int Cnt1) {
+			for(unsigned int Cnt2=0;Cnt2<NumberOfBinsX;Cnt2++) {
+				IppiSize Roi;
+				unsigned int StartIndexX=Cnt2*BinSize;
+				unsigned int StartIndexY=Cnt1*BinSize;
+				Roi.width=min(Width,(Cnt2+1)*BinSize)-StartIndexX;
+				Roi.height=min(Height,(Cnt1+1)*BinSize)-StartIndexY;
+				double Sum=0.0;
+				ippiSum_8u_C1R(ResultImage+StartIndexY*ResultByteStep+StartIndexX,ResultByteStep,Roi,&Sum);
+				double Area=Parameters.Roi ? (double)Parameters.Roi->GetAreaInRect(StartIndexX,StartIndexY,Roi.width,Roi.height) : (double)Roi.width*(double)Roi.height;
+				BinRecord& Bin=Grid.Bins[Cnt1*NumberOfBinsX+Cnt2];
+				Bin.Threshold=(float)OtsuThreshold[Cnt1*NumberOfBinsX+Cnt2];
+				Bin.BackgroundMean=(float)MeanBuffer[Cnt1*NumberOfBinsX+Cnt2];
+				Bin.BackgroundStd=(float)StdBuffer[Cnt1*NumberOfBinsX+Cnt2];
+				Bin.ForegroundFraction=(Area > 0.0) ? (float)(Sum/255.0/Area) : 0.0f;
+			}
+		};
+		if(Parameters.Parallel)
+			parallel_for(0u,NumberOfBinsY,FillGridRow);
+		else
+			for(unsigned int Cnt1=0;Cnt1<NumberOfBinsY;Cnt1++)
+				FillGridRow(Cnt1);
+	}
+
 	// Set ROI
-	Roi.width=Width;
-	Roi.height=Height;
+	IppiSize ImageRoi={(int)Width,(int)Height};
 
-	// Calculate result
-	Status=ippiSum_8u_C1R(ResultImage,ResultByteStep,Roi,&Result);
-	Result*=(100.0/255.0/(double)Width/(double)Height);	
+	// Calculate result, summed once over the final mask so it does not depend on the schedule
+	Status=ippiSum_8u_C1R(ResultImage,ResultByteStep,ImageRoi,&Result);
+	double Area=Roi ? Roi->GetArea() : (double)Width*(double)Height;
+	Result=(Area > 0.0) ? Result*(100.0/255.0/Area) : 0.0;
 
 //	WritePgmFile<unsigned char>("D:\\Maya\\TestD.pgm",ResultImage,Width,Height,ResultByteStep);
 
@@ -224,96 +823,174 @@ bool CalculateLines(const unsigned char* InputImage,unsigned int Width,unsigned
 	ippsFree(OtsuThreshold);
 	ippsFree(StdBuffer);
 	ippsFree(MeanBuffer);
-	ippsFree(OtsuBuffer);
+	ippsFree(BinClasses);
 
 	return true;
 }
 
-bool CalculateMeanStd(const unsigned char* Input,unsigned int InputByteStep,
-					  const unsigned char* Mask,unsigned int MaskByteStep,
-					  unsigned int Width,unsigned int Height,
-					  double& Mean,double& Std) {
+template <class T> bool CalculateLines(const T* InputImage,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+									   double& Result,unsigned char*& ResultImage,int& ResultByteStep,const LinesParameters& Parameters) {
 
-	double SumX=0.0,SumX2=0.0,SumN=0.0;
-	const unsigned char* InputlLine=NULL;
-	const unsigned char* MaskLine=NULL;
-	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
-		MaskLine=Mask+Cnt1*MaskByteStep;
-		InputlLine=Input+Cnt1*InputByteStep;
-	  for(unsigned int Cnt2=0;Cnt2<Width;Cnt2++) {
-		  if(MaskLine[Cnt2] == 255)
-			  continue;
-		  SumX+=(double)InputlLine[Cnt2];
-		  SumX2+=((double)InputlLine[Cnt2]*(double)InputlLine[Cnt2]);
-		  SumN+=1.0;
-	  }
-	}
-	Mean=SumX/SumN;
-	Std=sqrt(SumX2/SumN-Mean*Mean);
+	// Common bin sizes run kernels compiled for them, other sizes the generic ones
+	if(Parameters.SpecializedKernels) {
+		switch(Parameters.BinSize) {
+		case 32:
+			return CalculateLinesBins<T,32>(InputImage,Width,Height,ByteStep,Result,ResultImage,ResultByteStep,Parameters);
+		case 64:
+			return CalculateLinesBins<T,64>(InputImage,Width,Height,ByteStep,Result,ResultImage,ResultByteStep,Parameters);
+		case 128:
+			return CalculateLinesBins<T,128>(InputImage,Width,Height,ByteStep,Result,ResultImage,ResultByteStep,Parameters);
+		}
+	}
 
-	return true;
+	return CalculateLinesBins<T,0>(InputImage,Width,Height,ByteStep,Result,ResultImage,ResultByteStep,Parameters);
 }
 
-bool CalculateCircles(const unsigned char* InputImage, unsigned int Width, unsigned int Height, unsigned int InputImageByteStep,
-					  const unsigned char* MaskImage, unsigned int MaskImageByteStep, double& Result,
-					  unsigned char*& ResultImage, int& ResultByteStep) {
+IppStatus ComputeOtsuThreshold(const Ipp16u* Image,int ByteStep,IppiSize Roi,Ipp16u* Threshold) {
+
+	// Check inputs
+	if((Roi.width <= 0) || (Roi.height <= 0))
+		return ippStsSizeErr;
+
+	// Histogram bins span only the gray levels present, so narrow ranges are exact
+	Ipp16u MinGL=0,MaxGL=0;
+	IppStatus Status=ippiMinMax_16u_C1R(Image,ByteStep,Roi,&MinGL,&MaxGL);
+	if(Status != ippStsNoErr)
+		return Status;
+	const unsigned int BinWidth=((unsigned int)MaxGL-MinGL)/OtsuHistogramBins+1;
+	const unsigned int NumberOfBins=((unsigned int)MaxGL-MinGL)/BinWidth+1;
+
+	// Calculate histogram and the highest gray level present in each bin
+	unsigned int Histogram[OtsuHistogramBins];
+	Ipp16u BinMaxGL[OtsuHistogramBins];
+	memset(Histogram,0,NumberOfBins*sizeof(unsigned int));
+	memset(BinMaxGL,0,NumberOfBins*sizeof(Ipp16u));
+	for(int Cnt1=0;Cnt1<Roi.height;Cnt1++) {
+		const Ipp16u* ImageLine=PixelAt(Image,ByteStep,0,Cnt1);
+		for(int Cnt2=0;Cnt2<Roi.width;Cnt2++) {
+			unsigned int Bin=(ImageLine[Cnt2]-MinGL)/BinWidth;
+			Histogram[Bin]++;
+			if(ImageLine[Cnt2] > BinMaxGL[Bin])
+				BinMaxGL[Bin]=ImageLine[Cnt2];
+		}
+	}
+
+	// Find split maximizing the between class variance
+	double SumN=(double)Roi.width*(double)Roi.height,SumX=0.0;
+	for(unsigned int Cnt1=0;Cnt1<NumberOfBins;Cnt1++)
+		SumX+=(double)Cnt1*(double)Histogram[Cnt1];
+	double LowerN=0.0,LowerX=0.0,MaxVariance=-1.0;
+	unsigned int LowerBins=NumberOfBins;
+	for(unsigned int Cnt1=0;Cnt1+1<NumberOfBins;Cnt1++) {
+		LowerN+=(double)Histogram[Cnt1];
+		LowerX+=(double)Cnt1*(double)Histogram[Cnt1];
+		if((LowerN == 0.0) || (LowerN == SumN))
+			continue;
+		double MeanDiff=LowerX/LowerN-(SumX-LowerX)/(SumN-LowerN);
+		double Variance=LowerN*(SumN-LowerN)*MeanDiff*MeanDiff;
+		if(Variance > MaxVariance) {
+			MaxVariance=Variance;
+			LowerBins=Cnt1+1;
+		}
+	}
+
+	// Like the 8 bit IPP function, return the last gray level of the lower class, i.e. the highest one
+	// present in the image. Ties go to the first split, so the last bin of the lower class is never empty
+	*Threshold=BinMaxGL[LowerBins-1];
+
+	return ippStsNoErr;
+}
+
+template <class T> bool CalculateCircles(const T* InputImage, unsigned int Width, unsigned int Height, unsigned int InputImageByteStep,
+										 const unsigned char* MaskImage, unsigned int MaskImageByteStep, double& Result,
+										 unsigned char*& ResultImage, int& ResultByteStep, BinGrid* Grid, const RoiMask* Roi) {
 
 	IppStatus Status=ippStsNoErr;
 
+	// Check ROI
+	if (Roi && ((Roi->GetWidth() != Width) || (Roi->GetHeight() != Height))) {
+		printf("CalculateCircles failed, ROI size %ux%u does not match image size %ux%u\n", Roi->GetWidth(), Roi->GetHeight(), Width, Height);
+		return false;
+	}
+
 	// Allocate result buffer
-	ResultImage = ippiMalloc_8u_C1(Width, Height, &ResultByteStep);
+	ResultImage = PoolMalloc_8u_C1(Width, Height, &ResultByteStep);
 	if (!ResultImage) {
 		printf("CalculateCircles failed while trying to allocate result image buffer\n");
 		return false;
 	}
 	memset(ResultImage, 0, ResultByteStep * Height);
 
+	// Circles are also counted per bin of a grid filled by the lines algorithm
+	bool IsGridValid=Grid && Grid->BinSize && (Grid->Width == Width) && (Grid->Height == Height);
+	if(IsGridValid) {
+		for(unsigned int Cnt1 = 0; Cnt1 < Grid->Bins.size(); ++Cnt1)
+			Grid->Bins[Cnt1].NumberOfCircles = 0;
+		Grid->HasCircles = true;
+	}
+
+	// Without a ROI each row is a single span
+	const pair<unsigned int, unsigned int> FullRow(0, Width);
+
+	// Common grid bin sizes count per bin with kernels compiled for them
+	unsigned int (*Mark)(const T*, const unsigned char*, unsigned char*, unsigned int, unsigned int, T, BinRecord*, unsigned int) = MarkCircles<T, 0>;
+	if (IsGridValid && (Grid->BinSize == 32))
+		Mark = MarkCircles<T, 32>;
+	else if (IsGridValid && (Grid->BinSize == 64))
+		Mark = MarkCircles<T, 64>;
+	else if (IsGridValid && (Grid->BinSize == 128))
+		Mark = MarkCircles<T, 128>;
+
 	unsigned int NumberOfCircles = 0;
-	unsigned char Threshold = 240;
+	const T Threshold = (T)(240 * GrayLevelScale<T>());
 	for(unsigned int Cnt1 = 0; Cnt1 < Height; ++Cnt1) {
-		const unsigned char* ImageLine=InputImage + Cnt1 * InputImageByteStep;
-		const unsigned char* MaskLine=MaskImage + Cnt1 * InputImageByteStep;
+		const T* ImageLine=PixelAt(InputImage, InputImageByteStep, 0, Cnt1);
+		const unsigned char* MaskLine=MaskImage + Cnt1 * MaskImageByteStep;
 		unsigned char* ResultLine = ResultImage + Cnt1 * ResultByteStep;
-		for(unsigned int Cnt2 = 0; Cnt2 < Width; ++Cnt2) {
-			if (MaskLine[Cnt2] && (ImageLine[Cnt2] >= Threshold)) {
-				NumberOfCircles++;
-				ResultLine[Cnt2] = UCHAR_MAX;
-			}
-		}
+		BinRecord* GridRow = IsGridValid ? &Grid->Bins[(Cnt1 / Grid->BinSize) * Grid->NumberOfBinsX] : NULL;
+		const pair<unsigned int, unsigned int>* Spans = Roi ? Roi->GetSpans(Cnt1) : &FullRow;
+		unsigned int NumberOfSpans = Roi ? Roi->GetNumberOfSpans(Cnt1) : 1;
+		for(unsigned int Cnt3 = 0; Cnt3 < NumberOfSpans; ++Cnt3)
+			NumberOfCircles += Mark(ImageLine, MaskLine, ResultLine, Spans[Cnt3].first, Spans[Cnt3].second, Threshold, GridRow, IsGridValid ? Grid->BinSize : 0);
 	}
 
 	// Calculate number of lines
-	IppiSize Roi = {(int)Width,(int)Height};
-	Status = ippiSum_8u_C1R(MaskImage,MaskImageByteStep,Roi,&Result);
+	IppiSize ImageRoi = {(int)Width,(int)Height};
+	Status = ippiSum_8u_C1R(MaskImage,MaskImageByteStep,ImageRoi,&Result);
 	Result /= 255.0;
 	Result = (double)NumberOfCircles / (Result-(double)NumberOfCircles);
 
 	return true;
 }
 
-bool CalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteStep,unsigned int InputImageWidth,unsigned int InputImageHeight,double& Result) {
+bool CalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteStep,unsigned int InputImageWidth,unsigned int InputImageHeight,double& Result,
+						const RoiMask* Roi,unsigned int Radius,bool SpecializedKernels) {
 
 	IppStatus Status=ippStsNoErr;
 
 	// Check inputs
-	if(!(InputImage && InputImageByteStep && InputImageWidth && InputImageHeight)) {
+	if(!(InputImage && InputImageByteStep && InputImageWidth && InputImageHeight && Radius)) {
 		printf("Inputs to thin lines algorithms are incorrect\n");
 		return false;
 	}
-
-	// Create mask
-	const int R=8;
-	unsigned char Mask[(2*R+1)*(2*R+1)];
-	memset(Mask,0,(2*R+1)*(2*R+1));
-	for(int Cnt1=-R;Cnt1<=R;Cnt1++) {
-		for(int Cnt2=-R;Cnt2<=R;Cnt2++) {
-			double Radius=sqrt(pow((double)Cnt1,2)+pow((double)Cnt2,2));
-			if(Radius <= (double)R) {
-				Mask[(Cnt1+R)*(2*R+1)+Cnt2+R]=1;
-			}
-		}
+	if(Roi && ((Roi->GetWidth() != InputImageWidth) || (Roi->GetHeight() != InputImageHeight))) {
+		printf("Thin lines ROI size %ux%u does not match image size %ux%u\n",Roi->GetWidth(),Roi->GetHeight(),InputImageWidth,InputImageHeight);
+		return false;
 	}
 
+	// Create mask, common radii are tabulated
+	const int R=(int)Radius;
+	vector<unsigned char> MaskBuffer((2*R+1)*(2*R+1));
+	unsigned char* Mask=&MaskBuffer[0];
+	if(SpecializedKernels && (R == 4))
+		memcpy(Mask,DiskMask<4>::Instance.Values,MaskBuffer.size());
+	else if(SpecializedKernels && (R == 8))
+		memcpy(Mask,DiskMask<8>::Instance.Values,MaskBuffer.size());
+	else if(SpecializedKernels && (R == 12))
+		memcpy(Mask,DiskMask<12>::Instance.Values,MaskBuffer.size());
+	else
+		BuildDiskMask(R,Mask);
+
 	// Init the morphology state
 	IppiSize MaskSize={2*R+1,2*R+1};
 	IppiPoint Anchor={R,R};
@@ -322,44 +999,111 @@ bool CalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteSte
 
 	// Allocate result image
 	int MorphResultByteStep=0;
-	unsigned char* MorphResultBuffer=ippiMalloc_8u_C1(InputImageWidth,2*InputImageHeight,&MorphResultByteStep);
+	unsigned char* MorphResultBuffer=PoolMalloc_8u_C1(InputImageWidth,2*InputImageHeight,&MorphResultByteStep);
 	if(!MorphResultBuffer) {
 		printf("Failed to allocate memory for morphological image\n");
 		ippiMorphologyFree(MorphState);
+		return false;
 	}
 	unsigned char* MorphResult1=MorphResultBuffer;
 	unsigned char* MorphResult2=MorphResultBuffer+InputImageHeight*MorphResultByteStep;
 
 //	WritePgmFile<unsigned char>("D:\\Maya\\TestA.pgm",InputImage,InputImageWidth,InputImageHeight,InputImageByteStep);
 
-	// Apply erosion
-	IppiSize Roi={(int)InputImageWidth,(int)InputImageHeight};
-	Status=ippiErodeBorderReplicate_8u_C1R(InputImage,InputImageByteStep,MorphResult1,MorphResultByteStep,Roi,ippBorderRepl,MorphState);
+	// Find extent of mask pixels in each row. With a ROI the mask is cleared outside it first, so
+	// only the ROI spans are searched and rows outside the ROI take no part in the morphology
+	if(Roi)
+		Roi->Apply(InputImage,InputImageByteStep);
+	const pair<unsigned int,unsigned int> FullRow(0,InputImageWidth);
+	vector<int> RowFirstX(InputImageHeight,-1),RowLastX(InputImageHeight,-1);
+	for(unsigned int Cnt1=0;Cnt1<InputImageHeight;Cnt1++) {
+		const unsigned char* InputLine=InputImage+Cnt1*InputImageByteStep;
+		const pair<unsigned int,unsigned int>* Spans=Roi ? Roi->GetSpans(Cnt1) : &FullRow;
+		unsigned int NumberOfSpans=Roi ? Roi->GetNumberOfSpans(Cnt1) : 1;
+		for(unsigned int Cnt3=0;Cnt3<NumberOfSpans;Cnt3++) {
+			for(unsigned int Cnt2=Spans[Cnt3].first;Cnt2<Spans[Cnt3].second;Cnt2++) {
+				if(InputLine[Cnt2]) {
+					if(RowFirstX[Cnt1] < 0)
+						RowFirstX[Cnt1]=Cnt2;
+					RowLastX[Cnt1]=Cnt2;
+				}
+			}
+		}
+	}
+
+	// Thin lines are mask pixels outside the opening, so rows without mask pixels stay empty. Morphology
+	// runs on bands of mask rows extended by the 2R pixels erosion and dilation reach, bands closer than
+	// that are merged so no band reads rows another band already changed. The result equals processing
+	// the whole image at once
+	IppiSize BandRoi={(int)InputImageWidth,(int)InputImageHeight};
+	unsigned int BandStart=0;
+	while(BandStart < InputImageHeight) {
+
+		// Find next band
+		if(RowFirstX[BandStart] < 0) {
+			BandStart++;
+			continue;
+		}
+		unsigned int BandEnd=BandStart;
+		int FirstX=RowFirstX[BandStart],LastX=RowLastX[BandStart];
+		for(unsigned int Cnt1=BandStart+1;(Cnt1<InputImageHeight) && (Cnt1-BandEnd<=2*R);Cnt1++) {
+			if(RowFirstX[Cnt1] >= 0) {
+				BandEnd=Cnt1;
+				FirstX=min(FirstX,RowFirstX[Cnt1]);
+				LastX=max(LastX,RowLastX[Cnt1]);
+			}
+		}
+
+		// Set ROI of band
+		unsigned int StartIndexX=max(0,FirstX-2*R);
+		unsigned int StartIndexY=max(0,(int)BandStart-2*R);
+		BandRoi.width=min((int)InputImageWidth,LastX+2*R+1)-StartIndexX;
+		BandRoi.height=min((int)InputImageHeight,(int)BandEnd+2*R+1)-StartIndexY;
+		const unsigned char* BandInput=InputImage+StartIndexY*InputImageByteStep+StartIndexX;
+		unsigned char* BandMorph1=MorphResult1+StartIndexY*MorphResultByteStep+StartIndexX;
+		unsigned char* BandMorph2=MorphResult2+StartIndexY*MorphResultByteStep+StartIndexX;
+
+		// Apply erosion
+		Status=ippiErodeBorderReplicate_8u_C1R(BandInput,InputImageByteStep,BandMorph1,MorphResultByteStep,BandRoi,ippBorderRepl,MorphState);
 	
-//	WritePgmFile<unsigned char>("D:\\Maya\\TestErosion.pgm",MorphResult1,InputImageWidth,InputImageHeight,MorphResultByteStep);
+//		WritePgmFile<unsigned char>("D:\\Maya\\TestErosion.pgm",MorphResult1,InputImageWidth,InputImageHeight,MorphResultByteStep);
+
+		// Apply dilation
+		Status=ippiDilateBorderReplicate_8u_C1R(BandMorph1,MorphResultByteStep,BandMorph2,MorphResultByteStep,BandRoi,ippBorderRepl,MorphState);
 
-	// Apply dilation
-	Status=ippiDilateBorderReplicate_8u_C1R(MorphResult1,MorphResultByteStep,MorphResult2,MorphResultByteStep,Roi,ippBorderRepl,MorphState);
+//		WritePgmFile<unsigned char>("D:\\Maya\\TestDilation.pgm",MorphResult2,InputImageWidth,InputImageHeight,MorphResultByteStep);
 
-//	WritePgmFile<unsigned char>("D:\\Maya\\TestDilation.pgm",MorphResult2,InputImageWidth,InputImageHeight,MorphResultByteStep);
+		// Apply not
+		Status=ippiNot_8u_C1IR(BandMorph2,MorphResultByteStep,BandRoi);
 
-	// Apply not
-	Status=ippiNot_8u_C1IR(MorphResult2,MorphResultByteStep,Roi);
+//		WritePgmFile<unsigned char>("D:\\Maya\\TestNot.pgm",MorphResult2,InputImageWidth,InputImageHeight,MorphResultByteStep);
 
-//	WritePgmFile<unsigned char>("D:\\Maya\\TestNot.pgm",MorphResult2,InputImageWidth,InputImageHeight,MorphResultByteStep);
+		// Apply and to the band's own rows only
+		BandRoi.height=BandEnd-BandStart+1;
+		Status=ippiAnd_8u_C1IR(BandMorph2+(BandStart-StartIndexY)*MorphResultByteStep,MorphResultByteStep,
+							   InputImage+BandStart*InputImageByteStep+StartIndexX,InputImageByteStep,BandRoi);
 
-	// Apply and
-	Status=ippiAnd_8u_C1IR(MorphResult2,MorphResultByteStep,InputImage,InputImageByteStep,Roi);
+		BandStart=BandEnd+1;
+	}
 
 //	WritePgmFile<unsigned char>("D:\\Maya\\TestAnd.pgm",InputImage,InputImageWidth,InputImageHeight,InputImageByteStep);
 
 	// Free memory
 	ippiMorphologyFree(MorphState);
-	ippiFree(MorphResultBuffer);
+	PoolFree(MorphResultBuffer);
 
 	// Calculate result
-	Status=ippiSum_8u_C1R(InputImage,InputImageByteStep,Roi,&Result);
-	Result*=(100.0/255.0/(double)InputImageWidth/(double)InputImageHeight);
+	IppiSize ImageRoi={(int)InputImageWidth,(int)InputImageHeight};
+	Status=ippiSum_8u_C1R(InputImage,InputImageByteStep,ImageRoi,&Result);
+	double Area=Roi ? Roi->GetArea() : (double)InputImageWidth*(double)InputImageHeight;
+	Result=(Area > 0.0) ? Result*(100.0/255.0/Area) : 0.0;
 
 	return true;
-}
\ No newline at end of file
+}
+
+template bool CalculateLines<unsigned char>(const unsigned char*,unsigned int,unsigned int,unsigned int,double&,unsigned char*&,int&,const LinesParameters&);
+template bool CalculateLines<unsigned short>(const unsigned short*,unsigned int,unsigned int,unsigned int,double&,unsigned char*&,int&,const LinesParameters&);
+template bool CalculateCircles<unsigned char>(const unsigned char*,unsigned int,unsigned int,unsigned int,const unsigned char*,unsigned int,double&,unsigned char*&,int&,BinGrid*,const RoiMask*);
+template bool CalculateCircles<unsigned short>(const unsigned short*,unsigned int,unsigned int,unsigned int,const unsigned char*,unsigned int,double&,unsigned char*&,int&,BinGrid*,const RoiMask*);
+template bool SubtractBackground<unsigned char>(const unsigned char*,unsigned int,unsigned int,unsigned int,unsigned int,bool,unsigned char*&,int&,const RoiMask*);
+template bool SubtractBackground<unsigned short>(const unsigned short*,unsigned int,unsigned int,unsigned int,unsigned int,bool,unsigned short*&,int&,const RoiMask*);
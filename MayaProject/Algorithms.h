@@ -1,5 +1,74 @@
-bool CalculateLines(const unsigned char* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,double& Result,unsigned char*& ResultImage,int& ResultByteStep);
-bool CalculateCircles(const unsigned char* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
-					  const unsigned char* MaskImage,unsigned int MaskImageByteStep,double& Result,
-					  unsigned char*& ResultImage, int& ResultByteStep);
-bool CalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteStep,unsigned int InputImageWidth,unsigned int InputImageHeight,double& Result);
\ No newline at end of file
+
+#ifndef ALGORITHMS_H
+#define ALGORITHMS_H
+
+#include <vector>
+
+#include "Roi.h"
+
+// Pixels added on each side of a lines bin whose statistics are too weak [Pixels]
+const unsigned int LinesRoiExpansion=64;
+
+// Columns (rows when transposed) processed together by the background running filters
+const unsigned int BackgroundStripWidth=64;
+
+// Summary of one lines bin, stored as is in grid files
+struct BinRecord {
+	float Threshold;			// Final Otsu threshold [Gray level]
+	float BackgroundMean;		// Mean of the pixels below the threshold [Gray level]
+	float BackgroundStd;		// Std of the pixels below the threshold [Gray level]
+	float ForegroundFraction;	// Fraction of the bin's pixels (of its ROI pixels with a ROI) in the lines mask
+	unsigned int NumberOfCircles;
+};
+
+// Bins of one image in row major order
+struct BinGrid {
+	BinGrid() : Width(0), Height(0), BinSize(0), NumberOfBinsX(0), NumberOfBinsY(0), HasCircles(false) {}
+	unsigned int Width;
+	unsigned int Height;
+	unsigned int BinSize;
+	unsigned int NumberOfBinsX;
+	unsigned int NumberOfBinsY;
+	bool HasCircles;
+	std::vector<BinRecord> Bins;
+};
+
+// Classes of lines bins
+enum BinClass {
+	BinEmpty=0,		// Flat and as dark as the darkest part of the image, no lines
+	BinUniform=1,	// Flat, either all lines or no lines
+	BinFull=2,		// Has structure, analysed at full resolution
+	BinOutside=3,	// No pixel inside the ROI, skipped
+	NumberOfBinClasses=4
+};
+
+// Options of the lines algorithm
+struct LinesParameters {
+	LinesParameters() : Parallel(true), Grid(NULL), PyramidFactor(0), BinClassCounts(NULL), Roi(NULL), BackgroundCorrected(false), BinSize(64), SpecializedKernels(true) {}
+	bool Parallel;					// Process bins on all cores, the result is identical to processing them serially
+	BinGrid* Grid;					// When set, receives the per bin statistics
+	unsigned int PyramidFactor;		// 2 or 4 classifies bins on a level downsampled by this factor first, 0 analyses all bins exactly
+	unsigned int* BinClassCounts;	// When set, receives the number of bins of each BinClass
+	const RoiMask* Roi;				// When set, only bins inside it are analysed, the mask is cleared outside it and the result is relative to its area
+	bool BackgroundCorrected;		// Image comes from SubtractBackground, weak bins take one image wide threshold instead of expanding
+	unsigned int BinSize;			// Side of the square bins [Pixels]
+	bool SpecializedKernels;		// Bin sizes 32, 64 and 128 use kernels compiled for them, false forces the generic kernels
+};
+
+// Lines and circles are instantiated for 8 bit (unsigned char) and 16 bit (unsigned short) images
+template <class T> bool CalculateLines(const T* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,double& Result,unsigned char*& ResultImage,int& ResultByteStep,
+									   const LinesParameters& Parameters=LinesParameters());
+template <class T> bool CalculateCircles(const T* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
+										 const unsigned char* MaskImage,unsigned int MaskImageByteStep,double& Result,
+										 unsigned char*& ResultImage, int& ResultByteStep, BinGrid* Grid=NULL, const RoiMask* Roi=NULL);
+// Subtract the background, the opening with a (2*Radius+1) square, into a new image (white top-hat) taken from
+// the buffer pool. The opening runs in the result with separable running minima and maxima costing O(1) per pixel
+// for any Radius, the input is only read. With a Roi only the rows that reach its rows are opened, the others are zero
+template <class T> bool SubtractBackground(const T* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,unsigned int Radius,
+										   bool Parallel,T*& ResultImage,int& ResultByteStep,const RoiMask* Roi=NULL);
+// Radius is the radius of the disk whose opening removes thin lines [Pixels], radii 4, 8 and 12 use precomputed
+// disks unless SpecializedKernels is false
+bool CalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteStep,unsigned int InputImageWidth,unsigned int InputImageHeight,double& Result,
+						const RoiMask* Roi=NULL,unsigned int Radius=8,bool SpecializedKernels=true);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,498 @@
+#include "ArchiveReader.h"
+
+#include <Windows.h>
+#include <stdio.h>
+#include <string.h>
+#include "zlib.h"
+
+using namespace std;
+
+// Tar header and data block size [Bytes]
+static const unsigned int TarBlockSize=512;
+
+// Largest zip end of central directory record, including its comment [Bytes]
+static const unsigned int ZipMaxEndRecordSize=22+0xFFFF;
+
+// Zip local header and its variable length fields can not exceed this size [Bytes]
+static const unsigned int ZipMaxLocalHeaderSize=30+0xFFFF+0xFFFF;
+
+static unsigned short GetUInt16(const unsigned char* Data) {
+
+	return (unsigned short)(Data[0] | (Data[1] << 8));
+}
+
+static unsigned int GetUInt32(const unsigned char* Data) {
+
+	return (unsigned int)Data[0] | ((unsigned int)Data[1] << 8) | ((unsigned int)Data[2] << 16) | ((unsigned int)Data[3] << 24);
+}
+
+static unsigned long long GetUInt64(const unsigned char* Data) {
+
+	return (unsigned long long)GetUInt32(Data) | ((unsigned long long)GetUInt32(Data + 4) << 32);
+}
+
+// Tar numeric fields are octal text, or big endian binary when the first byte has its high bit set
+static unsigned long long GetTarNumber(const unsigned char* Field, unsigned int FieldSize) {
+
+	unsigned long long Value=0;
+	if(Field[0] & 0x80) {
+		for(unsigned int Cnt1=1;Cnt1<FieldSize;Cnt1++)
+			Value=(Value << 8) | Field[Cnt1];
+		return Value;
+	}
+	for(unsigned int Cnt1=0;Cnt1<FieldSize;Cnt1++) {
+		if((Field[Cnt1] >= '0') && (Field[Cnt1] <= '7'))
+			Value=(Value << 3) | (Field[Cnt1] - '0');
+		else if(Value || (Field[Cnt1] != ' '))
+			break;
+	}
+	return Value;
+}
+
+static string GetTarString(const unsigned char* Field, unsigned int FieldSize) {
+
+	return string((const char*)Field, strnlen((const char*)Field, FieldSize));
+}
+
+ArchiveReader::ArchiveReader() : FileHandle(INVALID_HANDLE_VALUE), MappingHandle(NULL), FileSize(0), Granularity(0), Position(0), Current(NULL) {
+}
+
+ArchiveReader::~ArchiveReader() {
+
+	Close();
+}
+
+bool ArchiveReader::IsArchiveFileName(const string& FileName) {
+
+	string Extension=FileName.substr(FileName.find_last_of('.') == string::npos ? FileName.size() : FileName.find_last_of('.'));
+	for(unsigned int Cnt1=0;Cnt1<Extension.size();Cnt1++)
+		Extension[Cnt1]=(char)tolower(Extension[Cnt1]);
+
+	return (Extension == ".tar") || (Extension == ".zip");
+}
+
+bool ArchiveReader::Open(const string& ArchiveFileName) {
+
+	Close();
+	this->ArchiveFileName=ArchiveFileName;
+
+	// Open and map the whole file, member views are created on demand
+	FileHandle=CreateFileA(ArchiveFileName.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+	if(FileHandle == INVALID_HANDLE_VALUE) {
+		printf("ArchiveReader failed to open %s\n",ArchiveFileName.c_str());
+		return false;
+	}
+	LARGE_INTEGER Size;
+	if(!GetFileSizeEx(FileHandle,&Size) || !Size.QuadPart) {
+		printf("ArchiveReader failed to get the size of %s\n",ArchiveFileName.c_str());
+		Close();
+		return false;
+	}
+	FileSize=Size.QuadPart;
+	MappingHandle=CreateFileMappingA(FileHandle,NULL,PAGE_READONLY,0,0,NULL);
+	if(!MappingHandle) {
+		printf("ArchiveReader failed to map %s\n",ArchiveFileName.c_str());
+		Close();
+		return false;
+	}
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo(&SystemInfo);
+	Granularity=SystemInfo.dwAllocationGranularity;
+
+	// Build member index from the archive's own directory
+	unsigned char Signature[4]={0};
+	ReadAt(0,Signature,sizeof(Signature));
+	bool Status=(GetUInt32(Signature) == 0x04034b50) || (GetUInt32(Signature) == 0x06054b50) ? IndexZip() : IndexTar();
+	if(!Status) {
+		printf("ArchiveReader failed to index %s\n",ArchiveFileName.c_str());
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void ArchiveReader::Close() {
+
+	// Wait for a member still loading before its mapping goes away
+	if(Pending.valid()) {
+		MemberData* Data=Pending.get();
+		FreeMember(Data);
+	}
+	FreeMember(Current);
+	if(MappingHandle)
+		CloseHandle(MappingHandle);
+	if(FileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(FileHandle);
+	MappingHandle=NULL;
+	FileHandle=INVALID_HANDLE_VALUE;
+	FileSize=0;
+	Members.clear();
+	MemberIndices.clear();
+	Order.clear();
+	Position=0;
+}
+
+void ArchiveReader::GetMemberNames(vector<string>& MemberNames) const {
+
+	for(unsigned int Cnt1=0;Cnt1<Members.size();Cnt1++)
+		MemberNames.push_back(Members[Cnt1].Name);
+}
+
+bool ArchiveReader::Start(const vector<string>& MemberNames) {
+
+	if(Pending.valid()) {
+		MemberData* Data=Pending.get();
+		FreeMember(Data);
+	}
+	FreeMember(Current);
+	Order.clear();
+	Position=0;
+	for(unsigned int Cnt1=0;Cnt1<MemberNames.size();Cnt1++) {
+		map<string, unsigned int>::const_iterator Itr=MemberIndices.find(MemberNames[Cnt1]);
+		if(Itr == MemberIndices.end()) {
+			printf("ArchiveReader found no member %s in %s\n",MemberNames[Cnt1].c_str(),ArchiveFileName.c_str());
+			Order.clear();
+			return false;
+		}
+		Order.push_back(Itr->second);
+	}
+
+	// Load the first member in the background
+	if(Order.size())
+		Pending=async(launch::async,&ArchiveReader::LoadMember,this,Order[0]);
+
+	return true;
+}
+
+bool ArchiveReader::Next(string& MemberName, const unsigned char*& Data, size_t& DataSize) {
+
+	// Release the member returned last time
+	FreeMember(Current);
+	MemberName.clear();
+	Data=NULL;
+	DataSize=0;
+	if(Position >= Order.size())
+		return false;
+
+	// Take the loaded member and start loading the following one
+	MemberName=Members[Order[Position]].Name;
+	Current=Pending.get();
+	Position++;
+	if(Position < Order.size())
+		Pending=async(launch::async,&ArchiveReader::LoadMember,this,Order[Position]);
+	if(!Current)
+		return false;
+
+	Data=Current->Data;
+	DataSize=Current->Size;
+
+	return true;
+}
+
+bool ArchiveReader::ReadAt(unsigned long long Offset, void* Buffer, unsigned int Size) const {
+
+	// Positioned synchronous read, does not move the file pointer
+	OVERLAPPED Overlapped;
+	memset(&Overlapped,0,sizeof(Overlapped));
+	Overlapped.Offset=(DWORD)Offset;
+	Overlapped.OffsetHigh=(DWORD)(Offset >> 32);
+	DWORD BytesRead=0;
+
+	return ReadFile(FileHandle,Buffer,Size,&BytesRead,&Overlapped) && (BytesRead == Size);
+}
+
+void ArchiveReader::AddMember(const Member& NewMember) {
+
+	// Skip directories, later copies of a member replace earlier ones as on extraction
+	if(NewMember.Name.empty() || (NewMember.Name[NewMember.Name.size()-1] == '/'))
+		return;
+	map<string, unsigned int>::iterator Itr=MemberIndices.find(NewMember.Name);
+	if(Itr != MemberIndices.end()) {
+		Members[Itr->second]=NewMember;
+		return;
+	}
+	MemberIndices[NewMember.Name]=(unsigned int)Members.size();
+	Members.push_back(NewMember);
+}
+
+bool ArchiveReader::IndexTar() {
+
+	unsigned char Header[TarBlockSize];
+	unsigned long long Offset=0;
+	string LongName;
+	while(Offset + TarBlockSize <= FileSize) {
+
+		// Read header, an all zero block ends the archive
+		if(!ReadAt(Offset,Header,TarBlockSize))
+			return false;
+		bool IsZero=true;
+		for(unsigned int Cnt1=0;(Cnt1<TarBlockSize) && IsZero;Cnt1++)
+			IsZero=!Header[Cnt1];
+		if(IsZero)
+			break;
+
+		// Verify the header checksum, computed with the checksum field taken as spaces
+		unsigned long long CheckSum=8*' ';
+		for(unsigned int Cnt1=0;Cnt1<TarBlockSize;Cnt1++)
+			CheckSum+=((Cnt1 < 148) || (Cnt1 >= 156)) ? Header[Cnt1] : 0;
+		if(CheckSum != GetTarNumber(Header+148,8)) {
+			printf("ArchiveReader found a bad tar header at offset %llu\n",Offset);
+			return false;
+		}
+
+		unsigned long long Size=GetTarNumber(Header+124,12);
+		unsigned long long DataOffset=Offset + TarBlockSize;
+		if(DataOffset + Size > FileSize)
+			return false;
+		char TypeFlag=(char)Header[156];
+
+		// GNU long name and pax extended headers name the member that follows
+		if((TypeFlag == 'L') || (TypeFlag == 'x')) {
+			if(Size > 1024*1024)
+				return false;
+			vector<char> Data((size_t)Size + 1,0);
+			if(Size && !ReadAt(DataOffset,&Data[0],(unsigned int)Size))
+				return false;
+			if(TypeFlag == 'L') {
+				LongName=&Data[0];
+			}
+			else {
+				// Records are "<length> <key>=<value>\n"
+				unsigned int RecordOffset=0;
+				while(RecordOffset < Size) {
+					unsigned int RecordSize=(unsigned int)strtoul(&Data[RecordOffset],NULL,10);
+					if(!RecordSize || (RecordOffset + RecordSize > Size))
+						break;
+					string Record(&Data[RecordOffset],RecordSize);
+					size_t KeyStart=Record.find(' ');
+					if((KeyStart != string::npos) && !Record.compare(KeyStart + 1,5,"path="))
+						LongName=Record.substr(KeyStart + 6,Record.size() - KeyStart - 7);
+					RecordOffset+=RecordSize;
+				}
+			}
+		}
+		else if((TypeFlag == '0') || (TypeFlag == '\0') || (TypeFlag == '7')) {
+
+			// ustar splits long names into prefix and name
+			Member NewMember;
+			NewMember.Name=GetTarString(Header,100);
+			if(!memcmp(Header+257,"ustar",5) && Header[345])
+				NewMember.Name=GetTarString(Header+345,155) + "/" + NewMember.Name;
+			if(!LongName.empty())
+				NewMember.Name=LongName;
+			NewMember.Offset=DataOffset;
+			NewMember.CompressedSize=Size;
+			NewMember.Size=Size;
+			NewMember.Method=0;
+			NewMember.LocalHeader=false;
+			AddMember(NewMember);
+			LongName.clear();
+		}
+		else {
+			LongName.clear();
+		}
+
+		// Data is padded to whole blocks
+		Offset=DataOffset + (Size + TarBlockSize - 1) / TarBlockSize * TarBlockSize;
+	}
+
+	return true;
+}
+
+bool ArchiveReader::IndexZip() {
+
+	// Find the end of central directory record, searching back over a possible comment
+	unsigned int TailSize=(unsigned int)(FileSize < ZipMaxEndRecordSize ? FileSize : ZipMaxEndRecordSize);
+	vector<unsigned char> Tail(TailSize);
+	if((TailSize < 22) || !ReadAt(FileSize - TailSize,&Tail[0],TailSize))
+		return false;
+	int EndRecord=TailSize - 22;
+	while((EndRecord >= 0) && (GetUInt32(&Tail[EndRecord]) != 0x06054b50))
+		EndRecord--;
+	if(EndRecord < 0)
+		return false;
+	unsigned long long NumberOfEntries=GetUInt16(&Tail[EndRecord+10]);
+	unsigned long long DirectorySize=GetUInt32(&Tail[EndRecord+12]);
+	unsigned long long DirectoryOffset=GetUInt32(&Tail[EndRecord+16]);
+
+	// Archives over 4GB or 65535 members keep the real values in the zip64 record
+	unsigned long long EndRecordOffset=FileSize - TailSize + EndRecord;
+	unsigned char Locator[20];
+	if((EndRecordOffset >= sizeof(Locator)) && ReadAt(EndRecordOffset - sizeof(Locator),Locator,sizeof(Locator)) &&
+	   (GetUInt32(Locator) == 0x07064b50)) {
+		unsigned char EndRecord64[56];
+		if(!ReadAt(GetUInt64(Locator+8),EndRecord64,sizeof(EndRecord64)) || (GetUInt32(EndRecord64) != 0x06064b50))
+			return false;
+		NumberOfEntries=GetUInt64(EndRecord64+32);
+		DirectorySize=GetUInt64(EndRecord64+40);
+		DirectoryOffset=GetUInt64(EndRecord64+48);
+	}
+	if((DirectoryOffset + DirectorySize > FileSize) || (DirectorySize > 0xFFFFFFFF))
+		return false;
+
+	// Walk the central directory
+	vector<unsigned char> Directory((size_t)DirectorySize + 1);
+	if(DirectorySize && !ReadAt(DirectoryOffset,&Directory[0],(unsigned int)DirectorySize))
+		return false;
+	unsigned int Offset=0;
+	for(unsigned long long Cnt1=0;Cnt1<NumberOfEntries;Cnt1++) {
+		if((Offset + 46 > DirectorySize) || (GetUInt32(&Directory[Offset]) != 0x02014b50))
+			return false;
+		const unsigned char* Entry=&Directory[Offset];
+		unsigned short Flags=GetUInt16(Entry+8);
+		unsigned int NameSize=GetUInt16(Entry+28);
+		unsigned int ExtraSize=GetUInt16(Entry+30);
+		unsigned int CommentSize=GetUInt16(Entry+32);
+		if(Offset + 46 + NameSize + ExtraSize + CommentSize > DirectorySize)
+			return false;
+
+		Member NewMember;
+		NewMember.Name.assign((const char*)Entry+46,NameSize);
+		NewMember.Method=GetUInt16(Entry+10);
+		NewMember.CompressedSize=GetUInt32(Entry+20);
+		NewMember.Size=GetUInt32(Entry+24);
+		NewMember.Offset=GetUInt32(Entry+42);
+		NewMember.LocalHeader=true;
+
+		// Fields saturated at 0xFFFFFFFF follow in the zip64 extra field, in this order
+		const unsigned char* Extra=Entry+46+NameSize;
+		for(unsigned int ExtraOffset=0;ExtraOffset + 4 <= ExtraSize;) {
+			unsigned int FieldSize=GetUInt16(Extra+ExtraOffset+2);
+			if(GetUInt16(Extra+ExtraOffset) == 0x0001) {
+				const unsigned char* Field=Extra+ExtraOffset+4;
+				const unsigned char* FieldEnd=Field+FieldSize;
+				unsigned long long* Values[]={&NewMember.Size,&NewMember.CompressedSize,&NewMember.Offset};
+				for(unsigned int Cnt2=0;Cnt2<3;Cnt2++) {
+					if((*Values[Cnt2] == 0xFFFFFFFF) && (Field + 8 <= FieldEnd)) {
+						*Values[Cnt2]=GetUInt64(Field);
+						Field+=8;
+					}
+				}
+			}
+			ExtraOffset+=4 + FieldSize;
+		}
+		Offset+=46 + NameSize + ExtraSize + CommentSize;
+
+		// Only stored and deflated members without encryption can be read
+		if(Flags & 0x0001) {
+			printf("ArchiveReader skips encrypted member %s\n",NewMember.Name.c_str());
+			continue;
+		}
+		if((NewMember.Method != 0) && (NewMember.Method != 8)) {
+			printf("ArchiveReader skips member %s with compression method %u\n",NewMember.Name.c_str(),NewMember.Method);
+			continue;
+		}
+		AddMember(NewMember);
+	}
+
+	return true;
+}
+
+ArchiveReader::MemberData* ArchiveReader::LoadMember(unsigned int MemberIndex) const {
+
+	const Member& LoadedMember=Members[MemberIndex];
+	MemberData* Data=new MemberData;
+	Data->View=NULL;
+	Data->Data=NULL;
+	Data->Size=0;
+
+	// Zip members start after a local header whose size is only known once it is read
+	unsigned long long DataStart=LoadedMember.Offset;
+	unsigned long long MapEnd=LoadedMember.Offset + LoadedMember.CompressedSize;
+	if(LoadedMember.LocalHeader)
+		MapEnd+=ZipMaxLocalHeaderSize;
+	if(MapEnd > FileSize)
+		MapEnd=FileSize;
+
+	// Views must start on the allocation granularity
+	unsigned long long MapStart=DataStart / Granularity * Granularity;
+	if((MapEnd <= MapStart) || (MapEnd - MapStart > (size_t)-1)) {
+		printf("ArchiveReader can not map member %s\n",LoadedMember.Name.c_str());
+		delete Data;
+		return NULL;
+	}
+	Data->View=MapViewOfFile(MappingHandle,FILE_MAP_READ,(DWORD)(MapStart >> 32),(DWORD)MapStart,(size_t)(MapEnd - MapStart));
+	if(!Data->View) {
+		printf("ArchiveReader failed to map member %s\n",LoadedMember.Name.c_str());
+		delete Data;
+		return NULL;
+	}
+	const unsigned char* View=(const unsigned char*)Data->View;
+	unsigned long long ViewSize=MapEnd - MapStart;
+	const unsigned char* Compressed=View + (DataStart - MapStart);
+	if(LoadedMember.LocalHeader) {
+		const unsigned char* LocalHeader=Compressed;
+		if((DataStart + 30 > MapEnd) || (GetUInt32(LocalHeader) != 0x04034b50)) {
+			printf("ArchiveReader found a bad local header for member %s\n",LoadedMember.Name.c_str());
+			FreeMember(Data);
+			return NULL;
+		}
+		Compressed+=30 + GetUInt16(LocalHeader+26) + GetUInt16(LocalHeader+28);
+	}
+	if(Compressed + LoadedMember.CompressedSize > View + ViewSize) {
+		printf("ArchiveReader found member %s truncated\n",LoadedMember.Name.c_str());
+		FreeMember(Data);
+		return NULL;
+	}
+
+	if(LoadedMember.Method == 0) {
+
+		// Stored members are used in place, touch each page so the reads happen on this thread
+		volatile unsigned char Touch=0;
+		for(unsigned long long Cnt1=0;Cnt1<LoadedMember.Size;Cnt1+=4096)
+			Touch^=Compressed[Cnt1];
+		Data->Data=Compressed;
+		Data->Size=(size_t)LoadedMember.Size;
+	}
+	else {
+
+		// Inflate raw deflate data, then drop the view
+		if((LoadedMember.Size > (size_t)-1) || (LoadedMember.Size > 0xFFFFFFFF)) {
+			printf("ArchiveReader can not inflate member %s\n",LoadedMember.Name.c_str());
+			FreeMember(Data);
+			return NULL;
+		}
+		Data->Buffer.resize((size_t)LoadedMember.Size + 1);
+		z_stream Stream;
+		memset(&Stream,0,sizeof(Stream));
+		bool Status=(inflateInit2(&Stream,-MAX_WBITS) == Z_OK);
+		unsigned long long Remaining=LoadedMember.CompressedSize;
+		Stream.next_out=&Data->Buffer[0];
+		Stream.avail_out=(uInt)LoadedMember.Size;
+		Stream.next_in=(Bytef*)Compressed;
+		int InflateStatus=Z_OK;
+		while(Status && (InflateStatus == Z_OK)) {
+
+			// zlib counts in 32 bits, so large members are fed in chunks
+			if(!Stream.avail_in && Remaining) {
+				Stream.avail_in=(uInt)(Remaining > 0x40000000 ? 0x40000000 : Remaining);
+				Remaining-=Stream.avail_in;
+			}
+			InflateStatus=inflate(&Stream,Z_NO_FLUSH);
+		}
+		Status=Status && (InflateStatus == Z_STREAM_END) && (Stream.total_out == LoadedMember.Size);
+		inflateEnd(&Stream);
+		UnmapViewOfFile(Data->View);
+		Data->View=NULL;
+		if(!Status) {
+			printf("ArchiveReader failed to inflate member %s\n",LoadedMember.Name.c_str());
+			FreeMember(Data);
+			return NULL;
+		}
+		Data->Data=&Data->Buffer[0];
+		Data->Size=(size_t)LoadedMember.Size;
+	}
+
+	return Data;
+}
+
+void ArchiveReader::FreeMember(MemberData*& Data) const {
+
+	if(!Data)
+		return;
+	if(Data->View)
+		UnmapViewOfFile(Data->View);
+	delete Data;
+	Data=NULL;
+}
@@ -0,0 +1,68 @@
+#ifndef ARCHIVE_READER_H
+#define ARCHIVE_READER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <future>
+
+// Reads members of a tar or zip archive in place. Member data is served from file mappings
+// (stored members) or inflated buffers (deflated zip members), and the next member of the
+// requested order is loaded on a worker thread while the caller analyses the current one.
+class ArchiveReader {
+public:
+	ArchiveReader();
+	~ArchiveReader();
+
+	static bool IsArchiveFileName(const std::string& FileName);
+
+	bool Open(const std::string& ArchiveFileName);
+	void Close();
+
+	// Names of all regular file members as stored in the archive
+	void GetMemberNames(std::vector<std::string>& MemberNames) const;
+
+	// Set the order in which Next returns members and start loading the first one
+	bool Start(const std::vector<std::string>& MemberNames);
+
+	// Data stays valid until the following call to Next or Close. Returns false when a member
+	// failed to load, and also once all members were returned (MemberName is then empty)
+	bool Next(std::string& MemberName, const unsigned char*& Data, size_t& DataSize);
+
+private:
+	struct Member {
+		std::string Name;
+		unsigned long long Offset;
+		unsigned long long CompressedSize;
+		unsigned long long Size;
+		unsigned short Method;
+		bool LocalHeader;
+	};
+	struct MemberData {
+		void* View;
+		std::vector<unsigned char> Buffer;
+		const unsigned char* Data;
+		size_t Size;
+	};
+
+	bool ReadAt(unsigned long long Offset, void* Buffer, unsigned int Size) const;
+	bool IndexTar();
+	bool IndexZip();
+	void AddMember(const Member& NewMember);
+	MemberData* LoadMember(unsigned int MemberIndex) const;
+	void FreeMember(MemberData*& Data) const;
+
+	std::string ArchiveFileName;
+	void* FileHandle;
+	void* MappingHandle;
+	unsigned long long FileSize;
+	unsigned int Granularity;
+	std::vector<Member> Members;
+	std::map<std::string, unsigned int> MemberIndices;
+	std::vector<unsigned int> Order;
+	unsigned int Position;
+	std::future<MemberData*> Pending;
+	MemberData* Current;
+};
+
+#endif
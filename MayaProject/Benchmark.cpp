@@ -0,0 +1,228 @@
+#include "Benchmark.h"
+#include "ReadImageFromIO.h"
+#include "Kernels.h"
+#include "BufferPool.h"
+
+#include <Windows.h>
+#include <stdio.h>
+#include <float.h>
+#include <string.h>
+#include <vector>
+#include "ipp.h"
+
+using namespace std;
+
+// Best time of Repetitions runs [ms]
+template <class F> double BestTime(unsigned int Repetitions, F Function) {
+
+	LARGE_INTEGER StartTime,EndTime,Frequency;
+	QueryPerformanceFrequency(&Frequency);
+	double Best=DBL_MAX;
+	for(unsigned int Cnt1=0;Cnt1<Repetitions;Cnt1++) {
+		QueryPerformanceCounter(&StartTime);
+		Function();
+		QueryPerformanceCounter(&EndTime);
+		double Time=1000.0*(double)(EndTime.QuadPart-StartTime.QuadPart)/(double)Frequency.QuadPart;
+		if(Time < Best)
+			Best=Time;
+	}
+
+	return Best;
+}
+
+void PrintBenchmarkLine(const char* Name, double GenericTime, double SpecializedTime, bool IsIdentical) {
+	printf("%-28s generic %9.3f ms  specialized %9.3f ms  speedup %5.2fx  %s\n",Name,GenericTime,SpecializedTime,
+		   GenericTime/SpecializedTime,IsIdentical ? "identical" : "DIFFERENT");
+}
+
+bool BenchmarkKernels(const string& ImageFileName, unsigned int Repetitions) {
+
+	// Load image
+	unsigned int Width=0,Height=0;
+	int ByteStep=0;
+	unsigned char* Image=ReadImageTIF(ImageFileName,Width,Height,ByteStep);
+	if(!Image) {
+		printf("Failed while reading image %s\n",ImageFileName.c_str());
+		return false;
+	}
+	printf("Benchmark of %s (%ux%u), best of %u runs, serial\n",ImageFileName.c_str(),Width,Height,Repetitions);
+
+	const unsigned int BinSizes[]={32,64,128};
+	bool Status=true;
+	for(unsigned int Cnt1=0;Cnt1<sizeof(BinSizes)/sizeof(BinSizes[0]);Cnt1++) {
+
+		// Whole lines algorithm with each set of kernels, serial so kernel time is not hidden by scheduling
+		LinesParameters Parameters[2];
+		double LinesResult[2]={0.0,0.0};
+		unsigned char* LinesImage[2]={NULL,NULL};
+		int LinesByteStep[2]={0,0};
+		double LinesTime[2];
+		for(unsigned int Cnt2=0;Cnt2<2;Cnt2++) {
+			Parameters[Cnt2].Parallel=false;
+			Parameters[Cnt2].BinSize=BinSizes[Cnt1];
+			Parameters[Cnt2].SpecializedKernels=(Cnt2 == 1);
+			LinesTime[Cnt2]=BestTime(Repetitions,[&]() {
+				if(LinesImage[Cnt2])
+					PoolFree(LinesImage[Cnt2]);
+				LinesImage[Cnt2]=NULL;
+				CalculateLines(Image,Width,Height,ByteStep,LinesResult[Cnt2],LinesImage[Cnt2],LinesByteStep[Cnt2],Parameters[Cnt2]);
+			});
+		}
+		if(!LinesImage[0] || !LinesImage[1]) {
+			printf("Failed while calculating lines over image %s\n",ImageFileName.c_str());
+			if(LinesImage[0])
+				PoolFree(LinesImage[0]);
+			if(LinesImage[1])
+				PoolFree(LinesImage[1]);
+			Status=false;
+			break;
+		}
+		bool IsIdentical=(LinesResult[0] == LinesResult[1]);
+		for(unsigned int Cnt2=0;(Cnt2<Height) && IsIdentical;Cnt2++)
+			IsIdentical=!memcmp(LinesImage[0]+Cnt2*LinesByteStep[0],LinesImage[1]+Cnt2*LinesByteStep[1],Width);
+		char Name[64];
+		sprintf_s(Name,sizeof(Name),"Lines, bin %u",BinSizes[Cnt1]);
+		PrintBenchmarkLine(Name,LinesTime[0],LinesTime[1],IsIdentical);
+
+		// Masked statistics of every bin of the lines mask
+		unsigned int NumberOfBinsX=Width/BinSizes[Cnt1];
+		unsigned int NumberOfBinsY=Height/BinSizes[Cnt1];
+		vector<double> Mean[2],Std[2];
+		for(unsigned int Cnt2=0;Cnt2<2;Cnt2++) {
+			Mean[Cnt2].assign(NumberOfBinsX*NumberOfBinsY,0.0);
+			Std[Cnt2].assign(NumberOfBinsX*NumberOfBinsY,0.0);
+		}
+		double StatisticsTime[2];
+		for(unsigned int Cnt2=0;Cnt2<2;Cnt2++) {
+			StatisticsTime[Cnt2]=BestTime(Repetitions,[&]() {
+				for(unsigned int Cnt3=0;Cnt3<NumberOfBinsY;Cnt3++) {
+					for(unsigned int Cnt4=0;Cnt4<NumberOfBinsX;Cnt4++) {
+						unsigned int Index=Cnt3*NumberOfBinsX+Cnt4;
+						const unsigned char* Input=PixelAt(Image,ByteStep,Cnt4*BinSizes[Cnt1],Cnt3*BinSizes[Cnt1]);
+						const unsigned char* Mask=LinesImage[0]+Cnt3*BinSizes[Cnt1]*LinesByteStep[0]+Cnt4*BinSizes[Cnt1];
+						if(!Cnt2)
+							CalculateMeanStd(Input,ByteStep,Mask,LinesByteStep[0],BinSizes[Cnt1],BinSizes[Cnt1],Mean[Cnt2][Index],Std[Cnt2][Index]);
+						else if(BinSizes[Cnt1] == 32)
+							MaskedMeanStd<unsigned char,32>(Input,ByteStep,Mask,LinesByteStep[0],32,32,Mean[Cnt2][Index],Std[Cnt2][Index]);
+						else if(BinSizes[Cnt1] == 64)
+							MaskedMeanStd<unsigned char,64>(Input,ByteStep,Mask,LinesByteStep[0],64,64,Mean[Cnt2][Index],Std[Cnt2][Index]);
+						else
+							MaskedMeanStd<unsigned char,128>(Input,ByteStep,Mask,LinesByteStep[0],128,128,Mean[Cnt2][Index],Std[Cnt2][Index]);
+					}
+				}
+			});
+		}
+		IsIdentical=true;
+		for(unsigned int Cnt2=0;Cnt2<Mean[0].size();Cnt2++) {
+			if(!(((Mean[0][Cnt2] == Mean[1][Cnt2]) && (Std[0][Cnt2] == Std[1][Cnt2])) ||
+				 ((Mean[0][Cnt2] != Mean[0][Cnt2]) && (Mean[1][Cnt2] != Mean[1][Cnt2]))))
+				IsIdentical=false;
+		}
+		sprintf_s(Name,sizeof(Name),"Masked mean/std, bin %u",BinSizes[Cnt1]);
+		PrintBenchmarkLine(Name,StatisticsTime[0],StatisticsTime[1],IsIdentical);
+
+		// Circles counted into a grid of this bin size
+		int CirclesByteStep=0;
+		unsigned char* CirclesImage=ippiMalloc_8u_C1(Width,Height,&CirclesByteStep);
+		if(!CirclesImage) {
+			printf("BenchmarkKernels failed while trying to allocate circles image buffer\n");
+			PoolFree(LinesImage[0]);
+			PoolFree(LinesImage[1]);
+			Status=false;
+			break;
+		}
+		vector<BinRecord> GridBins[2];
+		unsigned int NumberOfCircles[2]={0,0};
+		double CirclesTime[2];
+		unsigned int GridBinsX=(Width+BinSizes[Cnt1]-1)/BinSizes[Cnt1];
+		unsigned int GridBinsY=(Height+BinSizes[Cnt1]-1)/BinSizes[Cnt1];
+		for(unsigned int Cnt2=0;Cnt2<2;Cnt2++) {
+			CirclesTime[Cnt2]=BestTime(Repetitions,[&]() {
+				GridBins[Cnt2].assign(GridBinsX*GridBinsY,BinRecord());
+				NumberOfCircles[Cnt2]=0;
+				for(unsigned int Cnt3=0;Cnt3<Height;Cnt3++) {
+					const unsigned char* ImageLine=PixelAt(Image,ByteStep,0,Cnt3);
+					const unsigned char* MaskLine=LinesImage[0]+Cnt3*LinesByteStep[0];
+					unsigned char* ResultLine=CirclesImage+Cnt3*CirclesByteStep;
+					BinRecord* GridRow=&GridBins[Cnt2][(Cnt3/BinSizes[Cnt1])*GridBinsX];
+					if(!Cnt2)
+						NumberOfCircles[Cnt2]+=MarkCircles<unsigned char,0>(ImageLine,MaskLine,ResultLine,0,Width,240,GridRow,BinSizes[Cnt1]);
+					else if(BinSizes[Cnt1] == 32)
+						NumberOfCircles[Cnt2]+=MarkCircles<unsigned char,32>(ImageLine,MaskLine,ResultLine,0,Width,240,GridRow,32);
+					else if(BinSizes[Cnt1] == 64)
+						NumberOfCircles[Cnt2]+=MarkCircles<unsigned char,64>(ImageLine,MaskLine,ResultLine,0,Width,240,GridRow,64);
+					else
+						NumberOfCircles[Cnt2]+=MarkCircles<unsigned char,128>(ImageLine,MaskLine,ResultLine,0,Width,240,GridRow,128);
+				}
+			});
+		}
+		IsIdentical=(NumberOfCircles[0] == NumberOfCircles[1]);
+		for(unsigned int Cnt2=0;(Cnt2<GridBins[0].size()) && IsIdentical;Cnt2++)
+			IsIdentical=(GridBins[0][Cnt2].NumberOfCircles == GridBins[1][Cnt2].NumberOfCircles);
+		sprintf_s(Name,sizeof(Name),"Circles grid, bin %u",BinSizes[Cnt1]);
+		PrintBenchmarkLine(Name,CirclesTime[0],CirclesTime[1],IsIdentical);
+
+		// Free memory
+		ippiFree(CirclesImage);
+		PoolFree(LinesImage[0]);
+		PoolFree(LinesImage[1]);
+	}
+
+	// Thin lines of the lines mask with the precomputed disks and with disks built on each call. Both runs
+	// restore the mask they reduce in place, so both include the same copy
+	double LinesResult=0.0;
+	unsigned char* LinesImage=NULL;
+	int LinesByteStep=0;
+	LinesParameters Parameters;
+	Parameters.Parallel=false;
+	if(Status && !CalculateLines(Image,Width,Height,ByteStep,LinesResult,LinesImage,LinesByteStep,Parameters)) {
+		printf("Failed while calculating lines over image %s\n",ImageFileName.c_str());
+		Status=false;
+	}
+	unsigned char* ThinLinesImage[2]={NULL,NULL};
+	int ThinLinesByteStep[2]={0,0};
+	if(Status) {
+		ThinLinesImage[0]=ippiMalloc_8u_C1(Width,Height,&ThinLinesByteStep[0]);
+		ThinLinesImage[1]=ippiMalloc_8u_C1(Width,Height,&ThinLinesByteStep[1]);
+		if(!ThinLinesImage[0] || !ThinLinesImage[1]) {
+			printf("BenchmarkKernels failed while trying to allocate thin lines image buffer\n");
+			Status=false;
+		}
+	}
+	const int Radii[]={4,8,12};
+	for(unsigned int Cnt1=0;Status && (Cnt1<sizeof(Radii)/sizeof(Radii[0]));Cnt1++) {
+		double ThinLinesResult[2]={0.0,0.0};
+		double ThinLinesTime[2];
+		bool IsCalculated[2]={true,true};
+		for(unsigned int Cnt2=0;Cnt2<2;Cnt2++) {
+			ThinLinesTime[Cnt2]=BestTime(Repetitions,[&]() {
+				IppiSize ImageRoi={(int)Width,(int)Height};
+				ippiCopy_8u_C1R(LinesImage,LinesByteStep,ThinLinesImage[Cnt2],ThinLinesByteStep[Cnt2],ImageRoi);
+				IsCalculated[Cnt2]=IsCalculated[Cnt2] && CalculateThinLines(ThinLinesImage[Cnt2],ThinLinesByteStep[Cnt2],Width,Height,
+																			ThinLinesResult[Cnt2],NULL,Radii[Cnt1],Cnt2 == 1);
+			});
+		}
+		if(!IsCalculated[0] || !IsCalculated[1]) {
+			printf("Failed while calculating thin lines over image %s\n",ImageFileName.c_str());
+			Status=false;
+			break;
+		}
+		bool IsIdentical=(ThinLinesResult[0] == ThinLinesResult[1]);
+		for(unsigned int Cnt2=0;(Cnt2<Height) && IsIdentical;Cnt2++)
+			IsIdentical=!memcmp(ThinLinesImage[0]+Cnt2*ThinLinesByteStep[0],ThinLinesImage[1]+Cnt2*ThinLinesByteStep[1],Width);
+		char Name[64];
+		sprintf_s(Name,sizeof(Name),"Thin lines, radius %d",Radii[Cnt1]);
+		PrintBenchmarkLine(Name,ThinLinesTime[0],ThinLinesTime[1],IsIdentical);
+	}
+	if(ThinLinesImage[0])
+		ippiFree(ThinLinesImage[0]);
+	if(ThinLinesImage[1])
+		ippiFree(ThinLinesImage[1]);
+	if(LinesImage)
+		PoolFree(LinesImage);
+
+	// Free memory
+	PoolFree(Image);
+
+	return Status;
+}
@@ -0,0 +1,10 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <string>
+
+// Times the generic kernels against the ones compiled for fixed bin sizes and radii on one image, checks that
+// both give identical results and prints the best of Repetitions runs of each
+bool BenchmarkKernels(const std::string& ImageFileName, unsigned int Repetitions);
+
+#endif
@@ -0,0 +1,122 @@
+#include "BufferPool.h"
+
+#include <map>
+#include <mutex>
+#include "ipp.h"
+
+using namespace std;
+
+// Buffers are interchangeable when they were allocated for the same size and pixel type
+struct PoolKey {
+	int Width;
+	int Height;
+	int BytesPerPixel;
+	bool operator<(const PoolKey& Other) const {
+		if(Width != Other.Width)
+			return Width < Other.Width;
+		if(Height != Other.Height)
+			return Height < Other.Height;
+		return BytesPerPixel < Other.BytesPerPixel;
+	}
+};
+
+struct PooledBuffer {
+	PoolKey Key;
+	void* Buffer;
+	int ByteStep;
+};
+
+static mutex PoolMutex;
+static unsigned long long PoolLimit=0;
+static unsigned long long PoolBytes=0;
+static multimap<PoolKey, PooledBuffer> FreeBuffers;
+static map<void*, PooledBuffer> UsedBuffers;
+
+// Free released buffers until the pool is within Limit, called with the mutex held
+static void TrimPool(unsigned long long Limit) {
+	while((PoolBytes > Limit) && FreeBuffers.size()) {
+		multimap<PoolKey, PooledBuffer>::iterator Itr=FreeBuffers.begin();
+		PoolBytes-=(unsigned long long)Itr->second.ByteStep*Itr->second.Key.Height;
+		ippiFree(Itr->second.Buffer);
+		FreeBuffers.erase(Itr);
+	}
+}
+
+void SetBufferPoolLimit(unsigned long long Limit) {
+
+	lock_guard<mutex> Lock(PoolMutex);
+	PoolLimit=Limit;
+	TrimPool(PoolLimit);
+}
+
+unsigned long long GetBufferPoolLimit() {
+
+	lock_guard<mutex> Lock(PoolMutex);
+	return PoolLimit;
+}
+
+static void* PoolMalloc(int Width,int Height,int BytesPerPixel,int* ByteStep) {
+
+	PoolKey Key={Width,Height,BytesPerPixel};
+	{
+		// Reuse a released buffer of the same size
+		lock_guard<mutex> Lock(PoolMutex);
+		if(!PoolLimit) {
+			return (BytesPerPixel == 2) ? (void*)ippiMalloc_16u_C1(Width,Height,ByteStep) : (void*)ippiMalloc_8u_C1(Width,Height,ByteStep);
+		}
+		multimap<PoolKey, PooledBuffer>::iterator Itr=FreeBuffers.find(Key);
+		if(Itr != FreeBuffers.end()) {
+			PooledBuffer Buffer=Itr->second;
+			FreeBuffers.erase(Itr);
+			PoolBytes-=(unsigned long long)Buffer.ByteStep*Height;
+			UsedBuffers[Buffer.Buffer]=Buffer;
+			*ByteStep=Buffer.ByteStep;
+			return Buffer.Buffer;
+		}
+	}
+
+	// Allocate outside the lock and remember the size for PoolFree
+	PooledBuffer Buffer={Key,NULL,0};
+	Buffer.Buffer=(BytesPerPixel == 2) ? (void*)ippiMalloc_16u_C1(Width,Height,&Buffer.ByteStep) : (void*)ippiMalloc_8u_C1(Width,Height,&Buffer.ByteStep);
+	if(!Buffer.Buffer)
+		return NULL;
+	lock_guard<mutex> Lock(PoolMutex);
+	UsedBuffers[Buffer.Buffer]=Buffer;
+	*ByteStep=Buffer.ByteStep;
+
+	return Buffer.Buffer;
+}
+
+unsigned char* PoolMalloc_8u_C1(int Width,int Height,int* ByteStep) {
+	return (unsigned char*)PoolMalloc(Width,Height,1,ByteStep);
+}
+
+unsigned short* PoolMalloc_16u_C1(int Width,int Height,int* ByteStep) {
+	return (unsigned short*)PoolMalloc(Width,Height,2,ByteStep);
+}
+
+void PoolFree(void* Buffer) {
+
+	if(!Buffer)
+		return;
+
+	// Buffers not taken from the pool are freed right away
+	lock_guard<mutex> Lock(PoolMutex);
+	map<void*, PooledBuffer>::iterator Itr=UsedBuffers.find(Buffer);
+	if(Itr == UsedBuffers.end()) {
+		ippiFree(Buffer);
+		return;
+	}
+	PooledBuffer Released=Itr->second;
+	UsedBuffers.erase(Itr);
+
+	// Keep it while it fits, making room by freeing buffers of other sizes
+	unsigned long long Size=(unsigned long long)Released.ByteStep*Released.Key.Height;
+	if(Size > PoolLimit) {
+		ippiFree(Buffer);
+		return;
+	}
+	TrimPool(PoolLimit-Size);
+	FreeBuffers.insert(make_pair(Released.Key,Released));
+	PoolBytes+=Size;
+}
@@ -0,0 +1,18 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+// Image buffers released after use are kept for the next image of the same size, so a resident process
+// analysing a stream of similar images stops allocating once it is warm. The pool is off until a limit
+// is set, then buffers taken from it must be released with PoolFree
+
+// Most bytes kept in released buffers, 0 turns the pool off and frees the buffers it holds
+void SetBufferPoolLimit(unsigned long long Limit);
+unsigned long long GetBufferPoolLimit();
+
+unsigned char* PoolMalloc_8u_C1(int Width,int Height,int* ByteStep);
+unsigned short* PoolMalloc_16u_C1(int Width,int Height,int* ByteStep);
+
+// Keeps a buffer from PoolMalloc for reuse, any other ippiMalloc buffer is released with ippiFree
+void PoolFree(void* Buffer);
+
+#endif
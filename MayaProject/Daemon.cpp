@@ -0,0 +1,369 @@
+#include "Daemon.h"
+
+#include <Windows.h>
+#include <stdio.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+using namespace std;
+
+// Pipe message buffer size [Bytes]
+static const unsigned int PipeBufferSize=64*1024;
+
+// Interval at which files still open for writing are checked again [ms]
+static const DWORD PendingPollInterval=500;
+
+// Time a connected client has to send its job [ms]
+static const DWORD JobReadTimeout=5000;
+
+// Number of processed files remembered, the oldest quarter is forgotten beyond it
+static const unsigned int MaxProcessedFiles=64*1024;
+
+// Size and last write time of a file
+typedef pair<unsigned long long, unsigned long long> FileStamp;
+
+bool IsFileClosedForWriting(const string& FileName) {
+
+	// Opening without FILE_SHARE_WRITE fails while any writer still holds the file
+	HANDLE Handle=CreateFileA(FileName.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if(Handle == INVALID_HANDLE_VALUE)
+		return false;
+	CloseHandle(Handle);
+
+	return true;
+}
+
+// Size and last write time identify one version of a file
+bool GetFileStamp(const string& FileName,FileStamp& Stamp) {
+
+	WIN32_FILE_ATTRIBUTE_DATA Attributes;
+	if(!GetFileAttributesExA(FileName.c_str(),GetFileExInfoStandard,&Attributes))
+		return false;
+	Stamp.first=((unsigned long long)Attributes.nFileSizeHigh<<32)|Attributes.nFileSizeLow;
+	Stamp.second=((unsigned long long)Attributes.ftLastWriteTime.dwHighDateTime<<32)|Attributes.ftLastWriteTime.dwLowDateTime;
+
+	return true;
+}
+
+void TrimProcessedFiles(map<string, FileStamp>& ProcessedFiles) {
+
+	// Forget the files written longest ago, a change notification for one of them processes it again
+	if(ProcessedFiles.size() <= MaxProcessedFiles)
+		return;
+	vector<unsigned long long> WriteTimes;
+	WriteTimes.reserve(ProcessedFiles.size());
+	for(map<string, FileStamp>::const_iterator Itr=ProcessedFiles.begin();Itr != ProcessedFiles.end();++Itr)
+		WriteTimes.push_back(Itr->second.second);
+	vector<unsigned long long>::iterator Cutoff=WriteTimes.begin()+(ProcessedFiles.size()-MaxProcessedFiles*3/4);
+	nth_element(WriteTimes.begin(),Cutoff,WriteTimes.end());
+	for(map<string, FileStamp>::iterator Itr=ProcessedFiles.begin();Itr != ProcessedFiles.end();) {
+		if(Itr->second.second < *Cutoff)
+			ProcessedFiles.erase(Itr++);
+		else
+			++Itr;
+	}
+}
+
+// Results file shared by the watch loop and the job thread
+struct ResultsFile {
+	FILE* Stream;
+	mutex Mutex;
+};
+
+string ProcessAndRecord(const string& ImageFileName,const ProcessingOptions& Options,ResultsFile& Results) {
+
+	// Run algorithms, images that could not be read have no results
+	map<string, double> ImageResults;
+	ProcessImage(ImageFileName,Options,ImageResults);
+	if(!ImageResults.size())
+		return "";
+
+	// Append results so they are visible as soon as the image is done
+	string Line=GetResultsLine(ImageFileName,ImageResults);
+	lock_guard<mutex> Lock(Results.Mutex);
+	fputs(Line.c_str(),Results.Stream);
+	fflush(Results.Stream);
+	printf("Finished processing %s\n",ImageFileName.c_str());
+
+	return Line;
+}
+
+bool StartDirectoryWatch(HANDLE DirHandle,vector<DWORD>& NotifyBuffer,OVERLAPPED& Overlapped) {
+
+	ResetEvent(Overlapped.hEvent);
+	if(!ReadDirectoryChangesW(DirHandle,&NotifyBuffer[0],(DWORD)(NotifyBuffer.size()*sizeof(DWORD)),TRUE,
+							  FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_LAST_WRITE|FILE_NOTIFY_CHANGE_SIZE,
+							  NULL,&Overlapped,NULL)) {
+		printf("RunDaemon failed to watch directory, error %u\n",GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+bool StartPipeConnect(HANDLE Pipe,OVERLAPPED& Overlapped) {
+
+	ResetEvent(Overlapped.hEvent);
+	if(ConnectNamedPipe(Pipe,&Overlapped))
+		return true;
+	switch(GetLastError()) {
+	case ERROR_IO_PENDING:
+		return true;
+	case ERROR_PIPE_CONNECTED:
+		SetEvent(Overlapped.hEvent);
+		return true;
+	default:
+		printf("RunDaemon failed to listen on %s, error %u\n",MAYA_PIPE_NAME,GetLastError());
+		return false;
+	}
+}
+
+void HandleJob(HANDLE Pipe,const ProcessingOptions& Options,ResultsFile& Results) {
+
+	OVERLAPPED Overlapped={0};
+	Overlapped.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+
+	// Read job path, a client that does not send one in time is dropped
+	char JobPath[MAX_PATH*4]={0};
+	DWORD NumberOfBytes=0;
+	if(!ReadFile(Pipe,JobPath,sizeof(JobPath)-1,NULL,&Overlapped) && (GetLastError() != ERROR_IO_PENDING)) {
+		CloseHandle(Overlapped.hEvent);
+		return;
+	}
+	if(WaitForSingleObject(Overlapped.hEvent,JobReadTimeout) != WAIT_OBJECT_0) {
+		CancelIo(Pipe);
+		GetOverlappedResult(Pipe,&Overlapped,&NumberOfBytes,TRUE);
+		CloseHandle(Overlapped.hEvent);
+		printf("RunDaemon dropped client that sent no job\n");
+		return;
+	}
+	if(!GetOverlappedResult(Pipe,&Overlapped,&NumberOfBytes,FALSE) || !NumberOfBytes) {
+		CloseHandle(Overlapped.hEvent);
+		return;
+	}
+	JobPath[NumberOfBytes]=0;
+	printf("RunDaemon received job %s\n",JobPath);
+
+	// A job is either a single image or a directory tree of images
+	vector<string> ImageFileNames;
+	DWORD Attributes=GetFileAttributesA(JobPath);
+	if((Attributes != INVALID_FILE_ATTRIBUTES) && (Attributes & FILE_ATTRIBUTE_DIRECTORY))
+		GetImageFileListFromDir(JobPath,"tif",ImageFileNames);
+	else if(Attributes != INVALID_FILE_ATTRIBUTES)
+		ImageFileNames.push_back(JobPath);
+
+	// Process job and send results back in the results file format, or a line saying why there are none
+	string Reply;
+	if(Attributes == INVALID_FILE_ATTRIBUTES) {
+		Reply="Error: the daemon can not access " + string(JobPath) + "\n";
+		printf("RunDaemon can not access job %s\n",JobPath);
+	}
+	else if(!ImageFileNames.size()) {
+		Reply="Error: the daemon found no *.tif files in " + string(JobPath) + "\n";
+	}
+	else {
+		Reply=GetResultsHeader();
+		for(unsigned int Cnt1=0;Cnt1<ImageFileNames.size();Cnt1++)
+			Reply+=ProcessAndRecord(ImageFileNames[Cnt1],Options,Results);
+	}
+	ResetEvent(Overlapped.hEvent);
+	if(WriteFile(Pipe,Reply.c_str(),(DWORD)Reply.size(),NULL,&Overlapped) || (GetLastError() == ERROR_IO_PENDING))
+		GetOverlappedResult(Pipe,&Overlapped,&NumberOfBytes,TRUE);
+	FlushFileBuffers(Pipe);
+
+	CloseHandle(Overlapped.hEvent);
+}
+
+bool RunDaemon(const string& InputDir,const ProcessingOptions& Options) {
+
+	// Open results file for appending, header is written only once
+	ResultsFile Results;
+	if(fopen_s(&Results.Stream,Options.ResultsFileName.c_str(),"ab")) {
+		printf("RunDaemon failed to open file to write results\n");
+		return false;
+	}
+	fseek(Results.Stream,0,SEEK_END);
+	if(!ftell(Results.Stream)) {
+		fputs(GetResultsHeader().c_str(),Results.Stream);
+		fflush(Results.Stream);
+	}
+
+	// Open directory for change notifications
+	HANDLE DirHandle=CreateFileA(InputDir.c_str(),FILE_LIST_DIRECTORY,FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,NULL,
+								 OPEN_EXISTING,FILE_FLAG_BACKUP_SEMANTICS|FILE_FLAG_OVERLAPPED,NULL);
+	if(DirHandle == INVALID_HANDLE_VALUE) {
+		printf("RunDaemon failed to open directory %s\n",InputDir.c_str());
+		fclose(Results.Stream);
+		return false;
+	}
+
+	// Create job pipe
+	HANDLE Pipe=CreateNamedPipeA(MAYA_PIPE_NAME,PIPE_ACCESS_DUPLEX|FILE_FLAG_OVERLAPPED,
+								 PIPE_TYPE_MESSAGE|PIPE_READMODE_MESSAGE|PIPE_WAIT|PIPE_REJECT_REMOTE_CLIENTS,
+								 1,PipeBufferSize,PipeBufferSize,0,NULL);
+	if(Pipe == INVALID_HANDLE_VALUE) {
+		printf("RunDaemon failed to create %s, is another daemon running?\n",MAYA_PIPE_NAME);
+		CloseHandle(DirHandle);
+		fclose(Results.Stream);
+		return false;
+	}
+
+	// Start both asynchronous operations
+	vector<DWORD> NotifyBuffer(16*1024);
+	OVERLAPPED DirOverlapped={0},PipeOverlapped={0};
+	DirOverlapped.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+	PipeOverlapped.hEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+	bool Status=StartDirectoryWatch(DirHandle,NotifyBuffer,DirOverlapped) && StartPipeConnect(Pipe,PipeOverlapped);
+
+	// Jobs run on their own thread so watched images keep being processed, the pipe accepts the next
+	// client once the job is done
+	thread JobThread;
+	HANDLE JobDoneEvent=CreateEvent(NULL,TRUE,FALSE,NULL);
+
+	printf("Watching %s, jobs are accepted on %s\n",InputDir.c_str(),MAYA_PIPE_NAME);
+
+	// Images that were created or changed and are waiting for their writer to close them, and the size and
+	// write time of those already processed so repeated change notifications do not add rows. Removed files
+	// are forgotten and the number remembered is capped, so a long running daemon does not grow
+	set<string> PendingFileNames;
+	map<string, FileStamp> ProcessedFiles;
+	while(Status) {
+
+		HANDLE Events[2]={DirOverlapped.hEvent,JobThread.joinable() ? JobDoneEvent : PipeOverlapped.hEvent};
+		DWORD WaitResult=WaitForMultipleObjects(2,Events,FALSE,PendingFileNames.size() ? PendingPollInterval : INFINITE);
+
+		// Collect changed image files
+		if(WaitResult == WAIT_OBJECT_0) {
+			DWORD NumberOfBytes=0;
+			if(!GetOverlappedResult(DirHandle,&DirOverlapped,&NumberOfBytes,FALSE)) {
+				printf("RunDaemon lost directory watch, error %u\n",GetLastError());
+				break;
+			}
+			if(!NumberOfBytes)
+				printf("RunDaemon change buffer overflowed, submit %s as a job to catch up\n",InputDir.c_str());
+			for(unsigned char* Entry=(unsigned char*)&NotifyBuffer[0];NumberOfBytes;) {
+				FILE_NOTIFY_INFORMATION* Info=(FILE_NOTIFY_INFORMATION*)Entry;
+				char FileName[MAX_PATH*4]={0};
+				WideCharToMultiByte(CP_ACP,0,Info->FileName,Info->FileNameLength/sizeof(WCHAR),FileName,sizeof(FileName)-1,NULL,NULL);
+				if(IsImageFileName(FileName,"tif")) {
+					string ImageFileName=InputDir + "\\" + FileName;
+					if((Info->Action == FILE_ACTION_ADDED) || (Info->Action == FILE_ACTION_MODIFIED) || (Info->Action == FILE_ACTION_RENAMED_NEW_NAME)) {
+						PendingFileNames.insert(ImageFileName);
+					}
+					else if((Info->Action == FILE_ACTION_REMOVED) || (Info->Action == FILE_ACTION_RENAMED_OLD_NAME)) {
+						PendingFileNames.erase(ImageFileName);
+						ProcessedFiles.erase(ImageFileName);
+					}
+				}
+				if(!Info->NextEntryOffset)
+					break;
+				Entry+=Info->NextEntryOffset;
+			}
+			Status=StartDirectoryWatch(DirHandle,NotifyBuffer,DirOverlapped);
+		}
+
+		// Serve ad-hoc job on a worker thread
+		else if((WaitResult == WAIT_OBJECT_0+1) && !JobThread.joinable()) {
+			ResetEvent(JobDoneEvent);
+			JobThread=thread([&]() {
+				HandleJob(Pipe,Options,Results);
+				SetEvent(JobDoneEvent);
+			});
+		}
+
+		// Accept the next client once the job is done
+		else if(WaitResult == WAIT_OBJECT_0+1) {
+			JobThread.join();
+			DisconnectNamedPipe(Pipe);
+			Status=StartPipeConnect(Pipe,PipeOverlapped);
+		}
+		else if(WaitResult != WAIT_TIMEOUT) {
+			printf("RunDaemon failed while waiting for events, error %u\n",GetLastError());
+			break;
+		}
+
+		// Process images whose writer has finished
+		for(set<string>::iterator Itr=PendingFileNames.begin();Itr != PendingFileNames.end();) {
+			if(GetFileAttributesA(Itr->c_str()) == INVALID_FILE_ATTRIBUTES) {
+				PendingFileNames.erase(Itr++);
+			}
+			else if(IsFileClosedForWriting(*Itr)) {
+				FileStamp Stamp(0,0);
+				bool IsStamped=GetFileStamp(*Itr,Stamp);
+				map<string, FileStamp>::iterator Processed=ProcessedFiles.find(*Itr);
+				if(!IsStamped || (Processed == ProcessedFiles.end()) || (Processed->second != Stamp)) {
+					ProcessAndRecord(*Itr,Options,Results);
+					if(IsStamped) {
+						ProcessedFiles[*Itr]=Stamp;
+						TrimProcessedFiles(ProcessedFiles);
+					}
+				}
+				PendingFileNames.erase(Itr++);
+			}
+			else {
+				++Itr;
+			}
+		}
+	}
+
+	// Release resources, a running job is finished first
+	if(JobThread.joinable())
+		JobThread.join();
+	CancelIo(DirHandle);
+	CancelIo(Pipe);
+	CloseHandle(DirOverlapped.hEvent);
+	CloseHandle(PipeOverlapped.hEvent);
+	CloseHandle(JobDoneEvent);
+	CloseHandle(Pipe);
+	CloseHandle(DirHandle);
+	fclose(Results.Stream);
+
+	return false;
+}
+
+bool SubmitJob(const string& JobPath) {
+
+	// The daemon runs in another working directory, so send an absolute path
+	char FullJobPath[MAX_PATH*4]={0};
+	DWORD FullJobPathLength=GetFullPathNameA(JobPath.c_str(),sizeof(FullJobPath),FullJobPath,NULL);
+	if(!FullJobPathLength || (FullJobPathLength >= sizeof(FullJobPath))) {
+		printf("SubmitJob failed to resolve path %s\n",JobPath.c_str());
+		return false;
+	}
+
+	// Connect to daemon, waiting while it serves another client
+	HANDLE Pipe=INVALID_HANDLE_VALUE;
+	while(true) {
+		Pipe=CreateFileA(MAYA_PIPE_NAME,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,0,NULL);
+		if(Pipe != INVALID_HANDLE_VALUE)
+			break;
+		if((GetLastError() != ERROR_PIPE_BUSY) || !WaitNamedPipeA(MAYA_PIPE_NAME,NMPWAIT_WAIT_FOREVER)) {
+			printf("SubmitJob failed to connect to %s, is the daemon running?\n",MAYA_PIPE_NAME);
+			return false;
+		}
+	}
+	DWORD Mode=PIPE_READMODE_MESSAGE;
+	SetNamedPipeHandleState(Pipe,&Mode,NULL,NULL);
+
+	// Send job
+	DWORD NumberOfBytes=0;
+	if(!WriteFile(Pipe,FullJobPath,FullJobPathLength,&NumberOfBytes,NULL)) {
+		printf("SubmitJob failed to send job, error %u\n",GetLastError());
+		CloseHandle(Pipe);
+		return false;
+	}
+
+	// Print results until the daemon closes the connection
+	vector<char> Buffer(PipeBufferSize+1);
+	while(ReadFile(Pipe,&Buffer[0],PipeBufferSize,&NumberOfBytes,NULL) || (GetLastError() == ERROR_MORE_DATA)) {
+		Buffer[NumberOfBytes]=0;
+		fputs(&Buffer[0],stdout);
+	}
+	CloseHandle(Pipe);
+
+	return true;
+}
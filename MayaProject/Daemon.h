@@ -0,0 +1,13 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include "MayaProject.h"
+
+// Name of the local pipe on which a running daemon accepts jobs
+#define MAYA_PIPE_NAME "\\\\.\\pipe\\MayaProject"
+
+bool RunDaemon(const std::string& InputDir, const ProcessingOptions& Options);
+bool SubmitJob(const std::string& JobPath);
+
+#endif
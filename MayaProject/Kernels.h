@@ -0,0 +1,144 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <math.h>
+#include <string.h>
+#include "Algorithms.h"
+
+// Inner loops of the algorithms. Kernels taking a size as template argument (FixedWidth, FixedBinSize, R) are
+// compiled for the common configurations, a size of 0 selects the generic version that takes it at run time
+
+// Pixel (X,Y) of an image with the given row byte step
+template <class T> inline const T* PixelAt(const T* Image,unsigned int ByteStep,unsigned int X,unsigned int Y) {
+	return (const T*)((const unsigned char*)Image+Y*ByteStep)+X;
+}
+
+// Mean and std of the pixels whose mask is not 255, generic version
+template <class T> bool CalculateMeanStd(const T* Input,unsigned int InputByteStep,
+										 const unsigned char* Mask,unsigned int MaskByteStep,
+										 unsigned int Width,unsigned int Height,
+										 double& Mean,double& Std) {
+
+	double SumX=0.0,SumX2=0.0,SumN=0.0;
+	const T* InputlLine=NULL;
+	const unsigned char* MaskLine=NULL;
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		MaskLine=Mask+Cnt1*MaskByteStep;
+		InputlLine=PixelAt(Input,InputByteStep,0,Cnt1);
+	  for(unsigned int Cnt2=0;Cnt2<Width;Cnt2++) {
+		  if(MaskLine[Cnt2] == 255)
+			  continue;
+		  SumX+=(double)InputlLine[Cnt2];
+		  SumX2+=((double)InputlLine[Cnt2]*(double)InputlLine[Cnt2]);
+		  SumN+=1.0;
+	  }
+	}
+	Mean=SumX/SumN;
+	Std=sqrt(SumX2/SumN-Mean*Mean);
+
+	return true;
+}
+
+// Same statistics without branches and with integer sums. The double sums of the generic version are exact
+// for bin sized regions, so the result is identical. FixedWidth is the width of interior bins or expanded ROIs
+template <class T,unsigned int FixedWidth> inline void MaskedMeanStd(const T* Input,unsigned int InputByteStep,
+																	 const unsigned char* Mask,unsigned int MaskByteStep,
+																	 unsigned int Width,unsigned int Height,
+																	 double& Mean,double& Std) {
+
+	const unsigned int RowWidth=FixedWidth ? FixedWidth : Width;
+	unsigned long long SumX=0,SumX2=0,SumN=0;
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		const T* InputLine=PixelAt(Input,InputByteStep,0,Cnt1);
+		const unsigned char* MaskLine=Mask+Cnt1*MaskByteStep;
+		unsigned int RowSumN=0;
+		unsigned long long RowSumX=0,RowSumX2=0;
+		for(unsigned int Cnt2=0;Cnt2<RowWidth;Cnt2++) {
+			unsigned int Value=(MaskLine[Cnt2] != 255)*(unsigned int)InputLine[Cnt2];
+			RowSumX+=Value;
+			RowSumX2+=(unsigned long long)Value*Value;
+			RowSumN+=(MaskLine[Cnt2] != 255);
+		}
+		SumX+=RowSumX;
+		SumX2+=RowSumX2;
+		SumN+=RowSumN;
+	}
+	Mean=(double)SumX/(double)SumN;
+	Std=sqrt((double)SumX2/(double)SumN-Mean*Mean);
+}
+
+// Copy the pixels below Threshold to Buffer without branches and return their number. Every pixel is
+// written at the current end of Buffer, which only advances past the ones kept
+template <class T,unsigned int FixedWidth> inline unsigned int GatherBelowThreshold(const T* Input,unsigned int InputByteStep,
+																					unsigned int Width,unsigned int Height,
+																					T Threshold,T* Buffer) {
+
+	const unsigned int RowWidth=FixedWidth ? FixedWidth : Width;
+	unsigned int NumberOfPixels=0;
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		const T* InputLine=PixelAt(Input,InputByteStep,0,Cnt1);
+		for(unsigned int Cnt2=0;Cnt2<RowWidth;Cnt2++) {
+			Buffer[NumberOfPixels]=InputLine[Cnt2];
+			NumberOfPixels+=(InputLine[Cnt2] < Threshold);
+		}
+	}
+
+	return NumberOfPixels;
+}
+
+// Mark circles, mask pixels at or above Threshold, in [StartX,EndX) of one row and return their number. When
+// GridRow is given they are also counted in its bins of FixedBinSize pixels, or BinSize when FixedBinSize is 0
+template <class T,unsigned int FixedBinSize> inline unsigned int MarkCircles(const T* ImageLine,const unsigned char* MaskLine,unsigned char* ResultLine,
+																			 unsigned int StartX,unsigned int EndX,T Threshold,
+																			 BinRecord* GridRow,unsigned int BinSize) {
+
+	const unsigned int Size=FixedBinSize ? FixedBinSize : BinSize;
+	unsigned int NumberOfCircles=0;
+	unsigned int Cnt1=StartX;
+	while(Cnt1 < EndX) {
+
+		// Segments end at bin borders
+		unsigned int SegmentEnd=EndX;
+		if(GridRow && ((Cnt1/Size+1)*Size < EndX))
+			SegmentEnd=(Cnt1/Size+1)*Size;
+		unsigned int Count=0;
+		for(;Cnt1<SegmentEnd;Cnt1++) {
+			unsigned int IsCircle=(MaskLine[Cnt1] != 0) & (ImageLine[Cnt1] >= Threshold);
+			ResultLine[Cnt1]=(unsigned char)(0-IsCircle);
+			Count+=IsCircle;
+		}
+		if(GridRow)
+			GridRow[(SegmentEnd-1)/Size].NumberOfCircles+=Count;
+		NumberOfCircles+=Count;
+	}
+
+	return NumberOfCircles;
+}
+
+// Disk of radius R in a (2R+1)x(2R+1) mask, generic version
+inline void BuildDiskMask(int R,unsigned char* Mask) {
+	memset(Mask,0,(2*R+1)*(2*R+1));
+	for(int Cnt1=-R;Cnt1<=R;Cnt1++) {
+		for(int Cnt2=-R;Cnt2<=R;Cnt2++) {
+			double Radius=sqrt(pow((double)Cnt1,2)+pow((double)Cnt2,2));
+			if(Radius <= (double)R) {
+				Mask[(Cnt1+R)*(2*R+1)+Cnt2+R]=1;
+			}
+		}
+	}
+}
+
+// Disk masks of the common radii, built once at start up. Comparing squared integer distances selects
+// exactly the pixels the generic version selects
+template <int R> struct DiskMask {
+	DiskMask() {
+		for(int Cnt1=-R;Cnt1<=R;Cnt1++)
+			for(int Cnt2=-R;Cnt2<=R;Cnt2++)
+				Values[(Cnt1+R)*(2*R+1)+Cnt2+R]=(Cnt1*Cnt1+Cnt2*Cnt2 <= R*R) ? 1 : 0;
+	}
+	unsigned char Values[(2*R+1)*(2*R+1)];
+	static const DiskMask Instance;
+};
+template <int R> const DiskMask<R> DiskMask<R>::Instance;
+
+#endif
@@ -0,0 +1,124 @@
+#include "MayaApi.h"
+
+#include <stdio.h>
+#include <string>
+#include "ipp.h"
+#include "ReadImageFromIO.h"
+#include "Algorithms.h"
+#include "BufferPool.h"
+
+using namespace std;
+
+void MayaInit() {
+
+	// Init IPP dispatcher once per process
+	ippInit();
+}
+
+void MayaFree(void* Buffer) {
+
+	if(Buffer)
+		PoolFree(Buffer);
+}
+
+unsigned char* MayaReadImageTIF(const char* InputFileName,unsigned int* ImageWidth,unsigned int* ImageHeight,int* ImageByteStep) {
+
+	// Check inputs
+	if(!(InputFileName && ImageWidth && ImageHeight && ImageByteStep)) {
+		printf("MayaReadImageTIF received invalid inputs\n");
+		return NULL;
+	}
+
+	return ReadImageTIF(InputFileName,*ImageWidth,*ImageHeight,*ImageByteStep);
+}
+
+unsigned short* MayaReadImageTIF16(const char* InputFileName,unsigned int* ImageWidth,unsigned int* ImageHeight,int* ImageByteStep) {
+
+	// Check inputs
+	if(!(InputFileName && ImageWidth && ImageHeight && ImageByteStep)) {
+		printf("MayaReadImageTIF16 received invalid inputs\n");
+		return NULL;
+	}
+
+	return ReadImageTIF16(InputFileName,*ImageWidth,*ImageHeight,*ImageByteStep);
+}
+
+template <class T> int CalculateLinesApi(const T* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+										  double* Result,unsigned char** ResultImage,int* ResultByteStep) {
+
+	// Check inputs
+	if(!(Image && Width && Height && (ByteStep >= Width*sizeof(T)) && Result && ResultImage && ResultByteStep)) {
+		printf("MayaCalculateLines received invalid inputs\n");
+		return 0;
+	}
+
+	// Run algorithm, result image is owned by the caller on success
+	*ResultImage=NULL;
+	if(!CalculateLines(Image,Width,Height,ByteStep,*Result,*ResultImage,*ResultByteStep)) {
+		MayaFree(*ResultImage);
+		*ResultImage=NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+template <class T> int CalculateCirclesApi(const T* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
+										   const unsigned char* MaskImage,unsigned int MaskImageByteStep,double* Result,
+										   unsigned char** ResultImage,int* ResultByteStep) {
+
+	// Check inputs
+	if(!(InputImage && InputImageWidth && InputImageHeight && (InputImageByteStep >= InputImageWidth*sizeof(T)) &&
+		 MaskImage && (MaskImageByteStep >= InputImageWidth) && Result && ResultImage && ResultByteStep)) {
+		printf("MayaCalculateCircles received invalid inputs\n");
+		return 0;
+	}
+
+	// Run algorithm, result image is owned by the caller on success
+	*ResultImage=NULL;
+	if(!CalculateCircles(InputImage,InputImageWidth,InputImageHeight,InputImageByteStep,MaskImage,MaskImageByteStep,*Result,*ResultImage,*ResultByteStep)) {
+		MayaFree(*ResultImage);
+		*ResultImage=NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+int MayaCalculateLines(const unsigned char* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+					   double* Result,unsigned char** ResultImage,int* ResultByteStep) {
+
+	return CalculateLinesApi(Image,Width,Height,ByteStep,Result,ResultImage,ResultByteStep);
+}
+
+int MayaCalculateLines16(const unsigned short* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+						 double* Result,unsigned char** ResultImage,int* ResultByteStep) {
+
+	return CalculateLinesApi(Image,Width,Height,ByteStep,Result,ResultImage,ResultByteStep);
+}
+
+int MayaCalculateCircles(const unsigned char* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
+						 const unsigned char* MaskImage,unsigned int MaskImageByteStep,double* Result,
+						 unsigned char** ResultImage,int* ResultByteStep) {
+
+	return CalculateCirclesApi(InputImage,InputImageWidth,InputImageHeight,InputImageByteStep,MaskImage,MaskImageByteStep,Result,ResultImage,ResultByteStep);
+}
+
+int MayaCalculateCircles16(const unsigned short* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
+						   const unsigned char* MaskImage,unsigned int MaskImageByteStep,double* Result,
+						   unsigned char** ResultImage,int* ResultByteStep) {
+
+	return CalculateCirclesApi(InputImage,InputImageWidth,InputImageHeight,InputImageByteStep,MaskImage,MaskImageByteStep,Result,ResultImage,ResultByteStep);
+}
+
+int MayaCalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteStep,unsigned int InputImageWidth,unsigned int InputImageHeight,double* Result) {
+
+	// Check inputs
+	if(!(InputImage && InputImageWidth && InputImageHeight && (InputImageByteStep >= InputImageWidth) && Result)) {
+		printf("MayaCalculateThinLines received invalid inputs\n");
+		return 0;
+	}
+
+	// Run algorithm, input image is updated in place
+	return CalculateThinLines(InputImage,InputImageByteStep,InputImageWidth,InputImageHeight,*Result) ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef MAYA_API_H
+#define MAYA_API_H
+
+// Plain C entry points exported from MayaApi.dll. All image arguments are borrowed
+// (never copied) and may use any row byte step; result images are allocated with
+// ippiMalloc and must be released with MayaFree.
+#ifdef MAYA_API_EXPORTS
+#define MAYA_API __declspec(dllexport)
+#else
+#define MAYA_API __declspec(dllimport)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MAYA_API void MayaInit();
+MAYA_API void MayaFree(void* Buffer);
+MAYA_API unsigned char* MayaReadImageTIF(const char* InputFileName,unsigned int* ImageWidth,unsigned int* ImageHeight,int* ImageByteStep);
+MAYA_API unsigned short* MayaReadImageTIF16(const char* InputFileName,unsigned int* ImageWidth,unsigned int* ImageHeight,int* ImageByteStep);
+MAYA_API int MayaCalculateLines(const unsigned char* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+								double* Result,unsigned char** ResultImage,int* ResultByteStep);
+MAYA_API int MayaCalculateCircles(const unsigned char* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
+								  const unsigned char* MaskImage,unsigned int MaskImageByteStep,double* Result,
+								  unsigned char** ResultImage,int* ResultByteStep);
+MAYA_API int MayaCalculateLines16(const unsigned short* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep,
+								  double* Result,unsigned char** ResultImage,int* ResultByteStep);
+MAYA_API int MayaCalculateCircles16(const unsigned short* InputImage,unsigned int InputImageWidth,unsigned int InputImageHeight,unsigned int InputImageByteStep,
+									const unsigned char* MaskImage,unsigned int MaskImageByteStep,double* Result,
+									unsigned char** ResultImage,int* ResultByteStep);
+MAYA_API int MayaCalculateThinLines(unsigned char* InputImage,unsigned int InputImageByteStep,unsigned int InputImageWidth,unsigned int InputImageHeight,double* Result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
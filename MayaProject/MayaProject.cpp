@@ -4,14 +4,25 @@
 #include "ReadImageFromIO.h"
 #include "ipp.h"
 #include "Algorithms.h"
+#include "MayaProject.h"
+#include "Daemon.h"
+#include "ArchiveReader.h"
+#include "Scheduler.h"
+#include "Benchmark.h"
+#include "BufferPool.h"
 #include <map>
+#include <algorithm>
 #include <float.h>
+#include <math.h>
 
 #pragma warning( disable : 1079 )
 
 using namespace std;
 
-bool GetImageFileListFromDir(const string& InputDir, const string& FileType, vector<string>& ImageFileNames);
+template <class T> bool RunAlgorithms(const T* InputImage, unsigned int ImageWidth, unsigned int ImageHeight, int ByteStep,
+									  const string& ImageFileName, const string& FilePrefix, const ProcessingOptions& Options, map<string, double>& Results);
+template <class T> void ValidateLines(const T* InputImage, unsigned int ImageWidth, unsigned int ImageHeight, int ByteStep,
+									  const unsigned char* LineImage, int LineByteStep, const RoiMask* Roi, const ProcessingOptions& Options, map<string, double>& Results);
 
 void main(int argc, char *argv[]) {
 
@@ -23,26 +34,125 @@ void main(int argc, char *argv[]) {
 		printf("Number of inputs is incorrect\n");
 		exit(0);
 	}
+
+	// Merge shard results files into the results file given as first input
+	if(!strcmp("Merge",argv[2])) {
+		MergeResultsFiles(argv[1],vector<string>(argv+3,argv+argc));
+		exit(0);
+	}
 	
 	// Set type of algorithm
-	bool SaveImages=false;
-	bool LinesAlgorithm=true;
-	bool CirclesAlgorithm=false;
-	bool ThinLinesAlgorithm=false;
+	ProcessingOptions Options;
+	bool WatchMode=false;
+	bool SubmitMode=false;
+	unsigned int BenchmarkRepetitions=0;
+	unsigned int ShardIndex=0,NumberOfShards=1;
+	bool IsOutputSet=false;
 	for(unsigned int Cnt1=2;Cnt1<argc;Cnt1++) {
 		if(!strcmp("SaveImages",argv[Cnt1])) {
-			SaveImages=true;
+			Options.SaveImages=true;
 		}
 		else if(!strcmp("Lines",argv[Cnt1])) {
-			LinesAlgorithm=true;
+			Options.LinesAlgorithm=true;
 		}
 		else if(!strcmp("Circles",argv[Cnt1])) {
-			CirclesAlgorithm=true;
-			LinesAlgorithm=true;
+			Options.CirclesAlgorithm=true;
+			Options.LinesAlgorithm=true;
 		}
 		else if(!strcmp("ThinLines",argv[Cnt1])) {
-			ThinLinesAlgorithm=true;
-			LinesAlgorithm=true;
+			Options.ThinLinesAlgorithm=true;
+			Options.LinesAlgorithm=true;
+		}
+		else if(!strcmp("Native16",argv[Cnt1])) {
+			Options.Native16=true;
+		}
+		else if(!strcmp("SaveGrid",argv[Cnt1])) {
+			Options.SaveGrid=true;
+			Options.LinesAlgorithm=true;
+		}
+		else if(!strncmp("Pyramid=",argv[Cnt1],8)) {
+			if((sscanf_s(argv[Cnt1]+8,"%u",&Options.PyramidFactor) != 1) || ((Options.PyramidFactor != 2) && (Options.PyramidFactor != 4))) {
+				printf("Pyramid must be given as Pyramid=2 or Pyramid=4\n");
+				exit(0);
+			}
+		}
+		else if(!strcmp("Validate",argv[Cnt1])) {
+			Options.Validate=true;
+		}
+		else if(!strcmp("Roi",argv[Cnt1])) {
+			Options.Roi=true;
+		}
+		else if(!strncmp("Roi=",argv[Cnt1],4)) {
+			Options.Roi=true;
+			Options.RoiFileName=argv[Cnt1]+4;
+		}
+		else if(!strncmp("Background=",argv[Cnt1],11)) {
+			if((sscanf_s(argv[Cnt1]+11,"%u",&Options.BackgroundRadius) != 1) || !Options.BackgroundRadius) {
+				printf("Background must be given as Background=<radius> with radius > 0\n");
+				exit(0);
+			}
+			Options.LinesAlgorithm=true;
+		}
+		else if(!strcmp("MemoryBudget",argv[Cnt1])) {
+
+			// Default to three quarters of the memory and address space currently available
+			Options.MemoryBudget=GetMemoryLimit();
+			if(!Options.MemoryBudget) {
+				printf("Failed to query available memory, give MemoryBudget=<MB>\n");
+				exit(0);
+			}
+		}
+		else if(!strncmp("MemoryBudget=",argv[Cnt1],13)) {
+			if((sscanf_s(argv[Cnt1]+13,"%llu",&Options.MemoryBudget) != 1) || !Options.MemoryBudget) {
+				printf("MemoryBudget must be given as MemoryBudget=<MB> with MB > 0\n");
+				exit(0);
+			}
+			Options.MemoryBudget<<=20;
+		}
+		else if(!strncmp("BinSize=",argv[Cnt1],8)) {
+			if((sscanf_s(argv[Cnt1]+8,"%u",&Options.BinSize) != 1) || !Options.BinSize) {
+				printf("BinSize must be given as BinSize=<n> with n > 0\n");
+				exit(0);
+			}
+		}
+		else if(!strncmp("ThinLinesRadius=",argv[Cnt1],16)) {
+			if((sscanf_s(argv[Cnt1]+16,"%u",&Options.ThinLinesRadius) != 1) || !Options.ThinLinesRadius) {
+				printf("ThinLinesRadius must be given as ThinLinesRadius=<r> with r > 0\n");
+				exit(0);
+			}
+			Options.ThinLinesAlgorithm=true;
+			Options.LinesAlgorithm=true;
+		}
+		else if(!strcmp("Benchmark",argv[Cnt1])) {
+			BenchmarkRepetitions=10;
+		}
+		else if(!strncmp("Benchmark=",argv[Cnt1],10)) {
+			if((sscanf_s(argv[Cnt1]+10,"%u",&BenchmarkRepetitions) != 1) || !BenchmarkRepetitions) {
+				printf("Benchmark must be given as Benchmark=<repetitions> with repetitions > 0\n");
+				exit(0);
+			}
+		}
+		else if(!strcmp("Numa",argv[Cnt1])) {
+			Options.Numa=true;
+		}
+		else if(!strcmp("Serial",argv[Cnt1])) {
+			Options.Serial=true;
+		}
+		else if(!strcmp("Watch",argv[Cnt1])) {
+			WatchMode=true;
+		}
+		else if(!strcmp("Submit",argv[Cnt1])) {
+			SubmitMode=true;
+		}
+		else if(!strncmp("Shard=",argv[Cnt1],6)) {
+			if((sscanf_s(argv[Cnt1]+6,"%u/%u",&ShardIndex,&NumberOfShards) != 2) || (ShardIndex >= NumberOfShards)) {
+				printf("Shard must be given as Shard=i/N with 0 <= i < N\n");
+				exit(0);
+			}
+		}
+		else if(!strncmp("Output=",argv[Cnt1],7)) {
+			Options.ResultsFileName=argv[Cnt1]+7;
+			IsOutputSet=true;
 		}
 		else {
 			printf("Unknown input %s\n",argv[Cnt1]);
@@ -50,182 +160,517 @@ void main(int argc, char *argv[]) {
 		}
 	}
 
+	// Validation compares pyramid mode with exact mode
+	if(Options.Validate && !Options.PyramidFactor) {
+		printf("Validate requires Pyramid=2 or Pyramid=4\n");
+		exit(0);
+	}
+
+	// Shards started from one directory must not share the default results file
+	if((NumberOfShards > 1) && !IsOutputSet) {
+		char ShardFileName[64];
+		sprintf_s(ShardFileName,sizeof(ShardFileName),"MayaResults_Shard%uof%u.csv",ShardIndex,NumberOfShards);
+		Options.ResultsFileName=ShardFileName;
+	}
+
+	// Send a job to a running daemon and print its results
+	if(SubmitMode) {
+		SubmitJob(argv[1]);
+		exit(0);
+	}
+
 	// Print information to screen
 	printf("************************************************\n");
 	printf("Input library: %s\n",argv[1]);
-	printf("Save images: %d\n",SaveImages);
-	printf("Lines %d Circles %d ThinLines: %d\n",LinesAlgorithm,CirclesAlgorithm,ThinLinesAlgorithm);
+	printf("Save images: %d\n",Options.SaveImages);
+	printf("Save grids: %d\n",Options.SaveGrid);
+	printf("Lines %d Circles %d ThinLines: %d\n",Options.LinesAlgorithm,Options.CirclesAlgorithm,Options.ThinLinesAlgorithm);
+	printf("Native 16 bit: %d\n",Options.Native16);
+	printf("Serial: %d\n",Options.Serial);
+	printf("Pyramid: %u Validate: %d\n",Options.PyramidFactor,Options.Validate);
+	printf("ROI: %d %s\n",Options.Roi,Options.RoiFileName.c_str());
+	printf("Background radius: %u\n",Options.BackgroundRadius);
+	printf("Memory budget: %llu MB NUMA: %d\n",Options.MemoryBudget>>20,Options.Numa);
+	printf("Bin size: %u Thin lines radius: %u\n",Options.BinSize,Options.ThinLinesRadius);
+	printf("Watch: %d\n",WatchMode);
+	printf("Shard: %u/%u\n",ShardIndex,NumberOfShards);
+	printf("Results file: %s\n",Options.ResultsFileName.c_str());
 	printf("************************************************\n\n");
+
+	// Keep released image buffers for the following images, which mostly have the same size
+	SetBufferPoolLimit(GetMemoryLimit()/8);
+
+	// Stay resident and process images as they arrive
+	if(WatchMode) {
+		RunDaemon(argv[1],Options);
+		exit(0);
+	}
 	
-	// Get image list from dir
+	// Get image list from dir, or from the members of an archive given instead of a dir
 	vector<string> ImageFileNames;
-	GetImageFileListFromDir(argv[1],"tif",ImageFileNames);
+	ArchiveReader Archive;
+	bool ArchiveMode=ArchiveReader::IsArchiveFileName(argv[1]);
+	if(ArchiveMode) {
+		if(!Archive.Open(argv[1]))
+			exit(0);
+		vector<string> MemberNames;
+		Archive.GetMemberNames(MemberNames);
+		for(unsigned int Cnt1=0;Cnt1<MemberNames.size();Cnt1++) {
+			if(IsImageFileName(MemberNames[Cnt1],"tif"))
+				ImageFileNames.push_back(MemberNames[Cnt1]);
+		}
+	}
+	else {
+		GetImageFileListFromDir(argv[1],"tif",ImageFileNames);
+	}
 	if(!ImageFileNames.size()) {
 		printf("Failed to find *.tif files in %s\n",argv[1]);
 		exit(0);
 	}
 
-	// Loop on all images and run algorithm
+	// Keep every N-th image of the sorted list so all shards agree on the partition, unsharded runs keep
+	// the directory order
+	if(NumberOfShards > 1) {
+		sort(ImageFileNames.begin(),ImageFileNames.end());
+		vector<string> ShardFileNames;
+		for(unsigned int Cnt1=ShardIndex;Cnt1<ImageFileNames.size();Cnt1+=NumberOfShards)
+			ShardFileNames.push_back(ImageFileNames[Cnt1]);
+		ImageFileNames.swap(ShardFileNames);
+		if(!ImageFileNames.size()) {
+			printf("Shard %u/%u has no images\n",ShardIndex,NumberOfShards);
+		}
+	}
+
+	// Compare the generic and the specialized kernels on each image instead of analysing them
+	if(BenchmarkRepetitions) {
+		if(ArchiveMode) {
+			printf("Benchmark needs a directory of images\n");
+			exit(0);
+		}
+		for(unsigned int Cnt1=0;Cnt1<ImageFileNames.size();Cnt1++)
+			BenchmarkKernels(ImageFileNames[Cnt1],BenchmarkRepetitions);
+		exit(0);
+	}
+
+	// Archive members are read ahead in this order while the previous one is analysed
+	if(ArchiveMode && !Archive.Start(ImageFileNames))
+		exit(0);
+
+	// Loop on all images and run algorithm, images of a directory run concurrently within a memory budget
+	map<unsigned int, map<string, double> > MapResults;
+	if(Options.MemoryBudget && ArchiveMode)
+		printf("MemoryBudget applies to directories, archive members are processed in order\n");
+	if(Options.MemoryBudget && !ArchiveMode) {
+		RunScheduledBatch(ImageFileNames,Options,MapResults);
+	}
+	else {
+		for(unsigned int Cnt1=0;Cnt1<ImageFileNames.size();Cnt1++) {
+
+			// Run algorithms, images that could not be read have no results
+			map<string, double> ImageResults;
+			bool Status=false;
+			if(ArchiveMode) {
+
+				// Members are keyed by archive and member path, saved images go next to the archive
+				string MemberName;
+				const unsigned char* Data=NULL;
+				size_t DataSize=0;
+				bool IsLoaded=Archive.Next(MemberName,Data,DataSize);
+				string SavePrefix=MemberName.substr(0,MemberName.find_last_of('.'));
+				replace(SavePrefix.begin(),SavePrefix.end(),'/','_');
+				SavePrefix=string(argv[1]).substr(0,strlen(argv[1]) - 4) + "_" + SavePrefix;
+				ImageFileNames[Cnt1]=string(argv[1]) + "\\" + MemberName;
+				if(IsLoaded)
+					Status=ProcessImage(ImageFileNames[Cnt1],SavePrefix,Data,DataSize,Options,ImageResults);
+				else
+					printf("Failed while reading image %s\n",ImageFileNames[Cnt1].c_str());
+			}
+			else {
+				Status=ProcessImage(ImageFileNames[Cnt1],Options,ImageResults);
+			}
+			if(ImageResults.size())
+				MapResults[Cnt1]=ImageResults;
+			if(!Status)
+				continue;
+
+			printf("Finished processing %u images out of %u\n",Cnt1+1,ImageFileNames.size());
+		}
+	}
+
+	// Open results file
+	FILE* ResultsStream;
+	if(fopen_s(&ResultsStream,Options.ResultsFileName.c_str(),"wb")) {
+		printf("Failed to open file to write results\n");
+		exit(0);
+	}
+
+	// Write results to file
+	fputs(GetResultsHeader().c_str(), ResultsStream);
+	map<unsigned int, map<string, double> >::const_iterator Itr = MapResults.begin();
+	for (; Itr != MapResults.end(); Itr++) {
+		fputs(GetResultsLine(ImageFileNames[Itr->first], Itr->second).c_str(), ResultsStream);
+	}
+
+	// Close stream
+	fclose(ResultsStream);
+
+	// Write deviation of pyramid mode from exact mode
+	if(Options.Validate) {
+		string ReportFileName=Options.ResultsFileName;
+		if((ReportFileName.size() > 4) && (ReportFileName.substr(ReportFileName.size()-4) == ".csv"))
+			ReportFileName.resize(ReportFileName.size()-4);
+		WriteValidationReport(ReportFileName + "_Validation.csv",ImageFileNames,MapResults);
+	}
+}
+
+bool ProcessImage(const string& ImageFileName, const ProcessingOptions& Options, map<string, double>& Results) {
+
+	// Saved images go next to the input image
+	return ProcessImage(ImageFileName,ImageFileName.substr(0,ImageFileName.size() - 4),NULL,0,Options,Results);
+}
+
+bool ProcessImage(const string& ImageName, const string& SavePrefix, const unsigned char* Data, size_t DataSize,
+				  const ProcessingOptions& Options, map<string, double>& Results) {
+
+	// Load image, 16 bit gray images are analysed at full depth when requested
 	unsigned int ImageWidth=0,ImageHeight=0;
 	int ByteStep=0;
-	unsigned char* InputImage=NULL;
-	map<unsigned int, map<string, double> > MapResults;
-	for(unsigned int Cnt1=0;Cnt1<ImageFileNames.size();Cnt1++) {
+	unsigned char* InputImage8=NULL;
+	unsigned short* InputImage16=NULL;
+	if(!ReadImageTIFAnyDepth(ImageName,Options.Native16,InputImage8,InputImage16,ImageWidth,ImageHeight,ByteStep,Data,DataSize)) {
+		printf("Failed while reading image %s\n",ImageName.c_str());
+		return false;
+	}
 
-		// Load image
-		InputImage=ReadImageTIF(ImageFileNames[Cnt1],ImageWidth,ImageHeight,ByteStep);
-		if(!InputImage) {
-			printf("Failed while reading image %s\n",ImageFileNames[Cnt1].c_str());
-			continue;
+	// Run algorithms
+	bool Status=false;
+	if(InputImage16) {
+		Status=RunAlgorithms(InputImage16,ImageWidth,ImageHeight,ByteStep,ImageName,SavePrefix,Options,Results);
+		PoolFree(InputImage16);
+	}
+	else {
+		Status=RunAlgorithms(InputImage8,ImageWidth,ImageHeight,ByteStep,ImageName,SavePrefix,Options,Results);
+		PoolFree(InputImage8);
+	}
+
+	return Status;
+}
+
+template <class T> bool RunAlgorithms(const T* InputImage, unsigned int ImageWidth, unsigned int ImageHeight, int ByteStep,
+									  const string& ImageFileName, const string& FilePrefix, const ProcessingOptions& Options, map<string, double>& Results) {
+
+	// Set output image
+	unsigned char* ResultLineImage=NULL;
+	int ResultLineByteStep=0;
+	unsigned char* ResultCircleImage = NULL;
+	int ResultCircleByteStep = 0;
+
+	// Initialize results
+	Results["Circles"] = DBL_MAX;
+	Results["Lines"] = DBL_MAX;
+	Results["ThinLines"] = DBL_MAX;
+
+	// Per bin statistics are collected by the lines and circles algorithms
+	BinGrid Grid;
+
+	// Images without a ROI file are analysed whole
+	RoiMask Roi;
+	const RoiMask* ImageRoi=NULL;
+	if(Options.Roi) {
+		string RoiFileName=Options.RoiFileName;
+		if(RoiFileName.empty()) {
+			RoiFileName=FilePrefix + "_ROI.tif";
+			if(GetFileAttributesA(RoiFileName.c_str()) == INVALID_FILE_ATTRIBUTES)
+				RoiFileName=FilePrefix + "_ROI.txt";
+		}
+		if(GetFileAttributesA(RoiFileName.c_str()) == INVALID_FILE_ATTRIBUTES) {
+			printf("No ROI found for image %s, analysing the whole image\n",ImageFileName.c_str());
 		}
+		else if(!ReadRoiFile(RoiFileName,ImageWidth,ImageHeight,Roi)) {
+			printf("Failed while reading ROI %s\n",RoiFileName.c_str());
+			return false;
+		}
+		else {
+			ImageRoi=&Roi;
+		}
+	}
 
-		// Set saved file name
-		string FilePrefix=ImageFileNames[Cnt1].c_str();
-		FilePrefix.resize(FilePrefix.size() - 4);
+	// Calculate lines algorithm
+	bool Status=true;
+	double LineResult=0.0;
+	if(Options.LinesAlgorithm) {
 		
-		// Set output image
-		unsigned char* ResultLineImage=NULL;
-		int ResultLineByteStep=0;
-		unsigned char* ResultCircleImage = NULL;
-		int ResultCircleByteStep = 0;
-
-		// Initialize results
-		MapResults[Cnt1]["Circles"] = DBL_MAX;
-		MapResults[Cnt1]["Lines"] = DBL_MAX;
-		MapResults[Cnt1]["ThinLines"] = DBL_MAX;
-
-		// Calculate lines algorithm
-		double LineResult=0.0;
-		if(LinesAlgorithm) {
-			
-			// Run algorithm
-			if (!CalculateLines(InputImage, ImageWidth, ImageHeight, ByteStep, LineResult, ResultLineImage, ResultLineByteStep)) {
-				printf("Failed while calculating lines over image %s\n",ImageFileNames[Cnt1].c_str());
-				if(InputImage) {
-					ippiFree(InputImage);
-					InputImage=NULL;
-				}
-				if (ResultLineImage) {
-					ippiFree(ResultLineImage);
-					ResultLineImage = NULL;
-				}
-				if (ResultCircleImage) {
-					ippiFree(ResultCircleImage);
-					ResultCircleImage = NULL;
-				}
-				continue;
+		// Flatten illumination first, circles still see the original gray levels
+		const T* LinesImage=InputImage;
+		int LinesByteStep=ByteStep;
+		T* CorrectedImage=NULL;
+		if (Options.BackgroundRadius) {
+			if (!SubtractBackground(InputImage, ImageWidth, ImageHeight, ByteStep, Options.BackgroundRadius, !Options.Serial, CorrectedImage, LinesByteStep, ImageRoi)) {
+				printf("Failed while subtracting background of image %s\n",ImageFileName.c_str());
+				return false;
 			}
+			LinesImage=CorrectedImage;
+		}
+
+		// Run algorithm
+		LinesParameters Parameters;
+		Parameters.Parallel=!Options.Serial;
+		Parameters.BackgroundCorrected=(CorrectedImage != NULL);
+		Parameters.Grid=Options.SaveGrid ? &Grid : NULL;
+		Parameters.PyramidFactor=Options.PyramidFactor;
+		unsigned int BinClassCounts[NumberOfBinClasses]={0};
+		Parameters.BinClassCounts=BinClassCounts;
+		Parameters.Roi=ImageRoi;
+		Parameters.BinSize=Options.BinSize;
+		LARGE_INTEGER StartTime,EndTime,Frequency;
+		QueryPerformanceCounter(&StartTime);
+		if (!CalculateLines(LinesImage, ImageWidth, ImageHeight, LinesByteStep, LineResult, ResultLineImage, ResultLineByteStep, Parameters)) {
+			printf("Failed while calculating lines over image %s\n",ImageFileName.c_str());
+			Status=false;
+		}
+		else {
 
 			// Update results
-			MapResults[Cnt1]["Lines"] = LineResult;
+			Results["Lines"] = LineResult;
+
+			// Compare with exact mode
+			if (Options.Validate) {
+				QueryPerformanceCounter(&EndTime);
+				QueryPerformanceFrequency(&Frequency);
+				Results["TimePyramid"] = 1000.0*(double)(EndTime.QuadPart-StartTime.QuadPart)/(double)Frequency.QuadPart;
+				Results["EmptyBins"] = BinClassCounts[BinEmpty];
+				Results["UniformBins"] = BinClassCounts[BinUniform];
+				Results["FullBins"] = BinClassCounts[BinFull];
+				ValidateLines(LinesImage, ImageWidth, ImageHeight, LinesByteStep, ResultLineImage, ResultLineByteStep, ImageRoi, Options, Results);
+			}
 
 			// Save images
-			if (SaveImages) {
+			if (Options.SaveImages) {
 				WritePgmFile<unsigned char>(FilePrefix + "_L.pgm", (const unsigned char*)ResultLineImage, ImageWidth, ImageHeight, ResultLineByteStep);
 			}
-		}		
+		}
+		if (CorrectedImage)
+			PoolFree(CorrectedImage);
+	}		
 
-		// Calculate dots algorithm
-		if(CirclesAlgorithm) {
-			
-			// Run algorithm
-			double CircleResult = 0.0;
-			if (!CalculateCircles(InputImage, ImageWidth, ImageHeight, ByteStep, ResultLineImage, ResultLineByteStep, CircleResult, ResultCircleImage, ResultCircleByteStep)) {
-				printf("Failed while calculating circles over image %s\n",ImageFileNames[Cnt1].c_str());
-				if(InputImage) {
-					ippiFree(InputImage);
-					InputImage=NULL;
-				}
-				if (ResultLineImage) {
-					ippiFree(ResultLineImage);
-					ResultLineImage = NULL;
-				}
-				if (ResultCircleImage) {
-					ippiFree(ResultCircleImage);
-					ResultCircleImage = NULL;
-				}
-				continue;
-			}
+	// Calculate dots algorithm
+	if(Status && Options.CirclesAlgorithm) {
+		
+		// Run algorithm
+		double CircleResult = 0.0;
+		if (!CalculateCircles(InputImage, ImageWidth, ImageHeight, ByteStep, ResultLineImage, ResultLineByteStep, CircleResult, ResultCircleImage, ResultCircleByteStep, Options.SaveGrid ? &Grid : NULL, ImageRoi)) {
+			printf("Failed while calculating circles over image %s\n",ImageFileName.c_str());
+			Status=false;
+		}
+		else {
 
 			// Update results
-			MapResults[Cnt1]["Circles"] = CircleResult;
+			Results["Circles"] = CircleResult;
 
 			// Save images
-			if (SaveImages) {
+			if (Options.SaveImages) {
 				WritePgmFile<unsigned char>(FilePrefix + "_C.pgm", (const unsigned char*)ResultCircleImage, ImageWidth, ImageHeight, ResultCircleByteStep);
-			}			
+			}
 		}
+	}
 
-		// Calculate thin lines algorithm
-		double ThinLineResult=0.0;
-		if(ThinLinesAlgorithm) {
-			
-			// Run algorithm
-			if (!CalculateThinLines(ResultLineImage, ResultLineByteStep, ImageWidth, ImageHeight, ThinLineResult)) {
-				printf("Failed while calculating thin lines over image %s\n",ImageFileNames[Cnt1].c_str());
-				if(InputImage) {
-					ippiFree(InputImage);
-					InputImage=NULL;
-				}
-				if (ResultLineImage) {
-					ippiFree(ResultLineImage);
-					ResultLineImage = NULL;
-				}
-				if (ResultCircleImage) {
-					ippiFree(ResultCircleImage);
-					ResultCircleImage = NULL;
-				}
-				continue;
-			}
+	// Calculate thin lines algorithm
+	double ThinLineResult=0.0;
+	if(Status && Options.ThinLinesAlgorithm) {
+		
+		// Run algorithm
+		if (!CalculateThinLines(ResultLineImage, ResultLineByteStep, ImageWidth, ImageHeight, ThinLineResult, ImageRoi, Options.ThinLinesRadius)) {
+			printf("Failed while calculating thin lines over image %s\n",ImageFileName.c_str());
+			Status=false;
+		}
+		else {
 
 			// Update results
-			MapResults[Cnt1]["ThinLines"] = ThinLineResult;
+			Results["ThinLines"] = ThinLineResult;
 			
 			// Save images
-			if (SaveImages) {
+			if (Options.SaveImages) {
 				//WritePgmFile<unsigned char>(FilePrefix + "_TL.pgm", (const unsigned char*)ResultImage, ImageWidth, ImageHeight, ResultByteStep);
 			}
 		}
-		
-		// Free memory
-		ippiFree(InputImage);
-		if (ResultLineImage)
-			ippiFree(ResultLineImage);
-		if (ResultCircleImage)
-			ippiFree(ResultCircleImage);
+	}
+	
+	// Save grid of the algorithms that succeeded
+	if (Options.SaveGrid && Grid.Bins.size()) {
+		WriteBinGridFile(FilePrefix + "_G.grid", Grid);
+	}
+
+	// Free memory
+	if (ResultLineImage)
+		PoolFree(ResultLineImage);
+	if (ResultCircleImage)
+		PoolFree(ResultCircleImage);
 
-		printf("Finished processing %u images out of %u\n",Cnt1+1,ImageFileNames.size());
+	return Status;
+}
+
+template <class T> void ValidateLines(const T* InputImage, unsigned int ImageWidth, unsigned int ImageHeight, int ByteStep,
+									  const unsigned char* LineImage, int LineByteStep, const RoiMask* Roi, const ProcessingOptions& Options, map<string, double>& Results) {
+
+	// Run exact mode
+	LinesParameters Parameters;
+	Parameters.Parallel=!Options.Serial;
+	Parameters.Roi=Roi;
+	Parameters.BackgroundCorrected=(Options.BackgroundRadius != 0);
+	Parameters.BinSize=Options.BinSize;
+	double ExactResult=0.0;
+	unsigned char* ExactImage=NULL;
+	int ExactByteStep=0;
+	LARGE_INTEGER StartTime,EndTime,Frequency;
+	QueryPerformanceCounter(&StartTime);
+	if (!CalculateLines(InputImage, ImageWidth, ImageHeight, ByteStep, ExactResult, ExactImage, ExactByteStep, Parameters)) {
+		printf("Failed while calculating exact lines for validation\n");
+		return;
+	}
+	QueryPerformanceCounter(&EndTime);
+	QueryPerformanceFrequency(&Frequency);
+
+	// Count mask pixels that differ
+	double NumberOfMismatches=0.0;
+	for (unsigned int Cnt1 = 0; Cnt1 < ImageHeight; Cnt1++) {
+		const unsigned char* LineRow=LineImage+Cnt1*LineByteStep;
+		const unsigned char* ExactRow=ExactImage+Cnt1*ExactByteStep;
+		for (unsigned int Cnt2 = 0; Cnt2 < ImageWidth; Cnt2++)
+			NumberOfMismatches+=(LineRow[Cnt2] != ExactRow[Cnt2]);
 	}
+	PoolFree(ExactImage);
 
-	// Open results file
-	FILE* ResultsStream;
-	if(fopen_s(&ResultsStream,"MayaResults.csv","wb")) {
-		printf("Failed to open file to write results\n");
-		exit(0);
+	// Update results
+	Results["LinesExact"] = ExactResult;
+	double Area = Roi ? Roi->GetArea() : (double)ImageWidth*(double)ImageHeight;
+	Results["MaskMismatch"] = (Area > 0.0) ? 100.0*NumberOfMismatches/Area : 0.0;
+	Results["TimeExact"] = 1000.0*(double)(EndTime.QuadPart-StartTime.QuadPart)/(double)Frequency.QuadPart;
+}
+
+bool WriteValidationReport(const string& ReportFileName, const vector<string>& ImageFileNames,
+						   const map<unsigned int, map<string, double> >& MapResults) {
+
+	// Open report file
+	FILE* ReportStream;
+	if(fopen_s(&ReportStream,ReportFileName.c_str(),"wb")) {
+		printf("WriteValidationReport failed to open %s\n",ReportFileName.c_str());
+		return false;
 	}
 
-	// Write results to file
-	fprintf(ResultsStream, "File name,ThinLines,Circles,Lines,\n");
-	map<unsigned int, map<string, double> >::const_iterator Itr = MapResults.begin();
-	for (; Itr != MapResults.end(); Itr++) {
-		fprintf(ResultsStream, "%s,", ImageFileNames[Itr->first].c_str());
-		if (Itr->second.at("ThinLines") == DBL_MAX)
-			fprintf(ResultsStream, ",");
-		else
-			fprintf(ResultsStream, "%03.8lf,", Itr->second.at("ThinLines"));
-		if (Itr->second.at("Circles") == DBL_MAX)
-			fprintf(ResultsStream, ",");
-		else
-			fprintf(ResultsStream, "%03.8lf,", Itr->second.at("Circles"));
-		if (Itr->second.at("Lines") == DBL_MAX)
-			fprintf(ResultsStream, ",");
-		else
-			fprintf(ResultsStream, "%03.8lf,", Itr->second.at("Lines"));
-		fprintf(ResultsStream, "\n");
+	// Write one line per validated image and accumulate totals
+	fputs("File name,Lines exact,Lines pyramid,Lines deviation,Mask mismatch [%],Empty bins,Uniform bins,Full bins,Exact time [ms],Pyramid time [ms],\n",ReportStream);
+	double SumDeviation=0.0,MaxDeviation=0.0,SumMismatch=0.0,SumFullBins=0.0,SumBins=0.0,SumExactTime=0.0,SumPyramidTime=0.0;
+	unsigned int NumberOfImages=0;
+	map<unsigned int, map<string, double> >::const_iterator Itr=MapResults.begin();
+	for(;Itr != MapResults.end();Itr++) {
+		const map<string, double>& Results=Itr->second;
+		if(!Results.count("LinesExact"))
+			continue;
+		double Deviation=Results.at("Lines")-Results.at("LinesExact");
+		fprintf(ReportStream,"%s,%03.8lf,%03.8lf,%03.8lf,%03.8lf,%.0lf,%.0lf,%.0lf,%.3lf,%.3lf,\n",QuoteCsvField(ImageFileNames[Itr->first]).c_str(),
+				Results.at("LinesExact"),Results.at("Lines"),Deviation,Results.at("MaskMismatch"),
+				Results.at("EmptyBins"),Results.at("UniformBins"),Results.at("FullBins"),Results.at("TimeExact"),Results.at("TimePyramid"));
+		SumDeviation+=fabs(Deviation);
+		MaxDeviation=max(MaxDeviation,fabs(Deviation));
+		SumMismatch+=Results.at("MaskMismatch");
+		SumFullBins+=Results.at("FullBins");
+		SumBins+=Results.at("EmptyBins")+Results.at("UniformBins")+Results.at("FullBins");
+		SumExactTime+=Results.at("TimeExact");
+		SumPyramidTime+=Results.at("TimePyramid");
+		NumberOfImages++;
+	}
+
+	// Write summary
+	if(NumberOfImages) {
+		fprintf(ReportStream,"\nImages,%u\n",NumberOfImages);
+		fprintf(ReportStream,"Mean absolute lines deviation,%03.8lf\n",SumDeviation/NumberOfImages);
+		fprintf(ReportStream,"Max absolute lines deviation,%03.8lf\n",MaxDeviation);
+		fprintf(ReportStream,"Mean mask mismatch [%%],%03.8lf\n",SumMismatch/NumberOfImages);
+		fprintf(ReportStream,"Full resolution bins [%%],%.3lf\n",100.0*SumFullBins/SumBins);
+		fprintf(ReportStream,"Speedup,%.3lf\n",SumExactTime/SumPyramidTime);
+		printf("Validation over %u images: mean |deviation| %.6lf, max |deviation| %.6lf, speedup %.2lf\n",
+			   NumberOfImages,SumDeviation/NumberOfImages,MaxDeviation,SumExactTime/SumPyramidTime);
 	}
 
 	// Close stream
-	fclose(ResultsStream);
+	fclose(ReportStream);
+
+	return true;
+}
+
+string QuoteCsvField(const string& Field) {
+
+	// Fields holding separators or quotes are quoted, quotes inside are doubled
+	if(Field.find_first_of(",\"\r\n") == string::npos)
+		return Field;
+	string Quoted="\"";
+	for(unsigned int Cnt1=0;Cnt1<Field.size();Cnt1++) {
+		if(Field[Cnt1] == '"')
+			Quoted+='"';
+		Quoted+=Field[Cnt1];
+	}
+	Quoted+='"';
+
+	return Quoted;
+}
+
+string GetFirstCsvField(const string& Line) {
+
+	// Undo the quoting of QuoteCsvField
+	if(Line.empty() || (Line[0] != '"'))
+		return Line.substr(0,Line.find(','));
+	string Field;
+	for(unsigned int Cnt1=1;Cnt1<Line.size();Cnt1++) {
+		if(Line[Cnt1] != '"') {
+			Field+=Line[Cnt1];
+		}
+		else if((Cnt1+1 < Line.size()) && (Line[Cnt1+1] == '"')) {
+			Field+='"';
+			Cnt1++;
+		}
+		else {
+			break;
+		}
+	}
+
+	return Field;
+}
+
+bool ReadTextLine(FILE* Stream,string& Line) {
+
+	// Read in chunks until the end of the line, so long lines are never cut
+	char Buffer[4096];
+	Line.clear();
+	while(fgets(Buffer,sizeof(Buffer),Stream)) {
+		Line+=Buffer;
+		if(Line[Line.size()-1] == '\n')
+			break;
+	}
+
+	return !Line.empty();
+}
+
+string GetResultsHeader() {
+
+	return "File name,ThinLines,Circles,Lines,\n";
+}
+
+string GetResultsLine(const string& ImageFileName, const map<string, double>& Results) {
+
+	// Missing results are left as empty fields
+	const char* Names[]={"ThinLines","Circles","Lines"};
+	char Value[64];
+	string Line=QuoteCsvField(ImageFileName) + ",";
+	for (unsigned int Cnt1 = 0; Cnt1 < sizeof(Names)/sizeof(Names[0]); Cnt1++) {
+		if (Results.at(Names[Cnt1]) != DBL_MAX) {
+			sprintf_s(Value, sizeof(Value), "%03.8lf", Results.at(Names[Cnt1]));
+			Line += Value;
+		}
+		Line += ",";
+	}
+	Line += "\n";
+
+	return Line;
 }
 
 #pragma warning( pop )
@@ -259,9 +704,7 @@ bool GetImageFileListFromDir(const string& InputDir,const string& FileType,vecto
 				GetImageFileListFromDir(InputDir + "\\" + FindFileData.cFileName,FileType,ImageFileNames);
 			}
 			else {
-				string FileName=FindFileData.cFileName;
-				IsType=(FileName.find(FileType) != string::npos);
-				IsType&=(FileName.find("_Comp") == string::npos);
+				IsType=IsImageFileName(FindFileData.cFileName,FileType);
 			}
 
 			// Update the name list
@@ -276,5 +719,58 @@ bool GetImageFileListFromDir(const string& InputDir,const string& FileType,vecto
 				bStatus=false;
 	}
 
+	// Release search handle
+	if(Handle != INVALID_HANDLE_VALUE)
+		FindClose(Handle);
+
+	return true;
+}
+
+bool MergeResultsFiles(const string& OutputFileName,const vector<string>& ShardFileNames) {
+
+	// Collect result lines from all shards, keyed by their file name
+	vector<pair<string, string> > Lines;
+	string Line;
+	for(unsigned int Cnt1=0;Cnt1<ShardFileNames.size();Cnt1++) {
+		FILE* ShardStream;
+		if(fopen_s(&ShardStream,ShardFileNames[Cnt1].c_str(),"rb")) {
+			printf("MergeResultsFiles failed to open %s\n",ShardFileNames[Cnt1].c_str());
+			return false;
+		}
+		if(!ReadTextLine(ShardStream,Line) || (GetResultsHeader() != Line)) {
+			printf("MergeResultsFiles found unknown header in %s\n",ShardFileNames[Cnt1].c_str());
+			fclose(ShardStream);
+			return false;
+		}
+		while(ReadTextLine(ShardStream,Line))
+			Lines.push_back(make_pair(GetFirstCsvField(Line),Line));
+		fclose(ShardStream);
+	}
+
+	// Shards partition a sorted file list, so merged results are in file name order
+	stable_sort(Lines.begin(),Lines.end(),[](const pair<string, string>& A,const pair<string, string>& B) { return A.first < B.first; });
+	for(unsigned int Cnt1=1;Cnt1<Lines.size();Cnt1++) {
+		if(Lines[Cnt1].first == Lines[Cnt1-1].first)
+			printf("MergeResultsFiles found %s in more than one shard\n",Lines[Cnt1].first.c_str());
+	}
+
+	// Write merged results
+	FILE* ResultsStream;
+	if(fopen_s(&ResultsStream,OutputFileName.c_str(),"wb")) {
+		printf("MergeResultsFiles failed to open %s\n",OutputFileName.c_str());
+		return false;
+	}
+	fputs(GetResultsHeader().c_str(),ResultsStream);
+	for(unsigned int Cnt1=0;Cnt1<Lines.size();Cnt1++)
+		fputs(Lines[Cnt1].second.c_str(),ResultsStream);
+	fclose(ResultsStream);
+
+	printf("Merged %u results from %u shards into %s\n",Lines.size(),ShardFileNames.size(),OutputFileName.c_str());
+
 	return true;
+}
+
+bool IsImageFileName(const string& FileName,const string& FileType) {
+
+	return (FileName.find(FileType) != string::npos) && (FileName.find("_Comp") == string::npos) && (FileName.find("_ROI.") == string::npos);
 }
\ No newline at end of file
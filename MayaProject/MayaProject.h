@@ -1 +1,44 @@
+#ifndef MAYA_PROJECT_H
+#define MAYA_PROJECT_H
 
+#include <string>
+#include <vector>
+#include <map>
+
+// Algorithms and outputs selected on the command line
+struct ProcessingOptions {
+	ProcessingOptions() : SaveImages(false), LinesAlgorithm(true), CirclesAlgorithm(false), ThinLinesAlgorithm(false), Native16(false), Serial(false), SaveGrid(false), PyramidFactor(0), Validate(false), Roi(false), BackgroundRadius(0), MemoryBudget(0), Numa(false), BinSize(64), ThinLinesRadius(8), ResultsFileName("MayaResults.csv") {}
+	bool SaveImages;
+	bool LinesAlgorithm;
+	bool CirclesAlgorithm;
+	bool ThinLinesAlgorithm;
+	bool Native16;
+	bool Serial;
+	bool SaveGrid;
+	unsigned int PyramidFactor;
+	bool Validate;
+	bool Roi;					// Restrict analysis to a ROI, RoiFileName for all images or <image>_ROI.tif / <image>_ROI.txt next to each
+	std::string RoiFileName;
+	unsigned int BackgroundRadius;		// Non zero subtracts the background, an opening of this radius, before lines
+	unsigned long long MemoryBudget;	// Bytes, non zero processes images of a directory concurrently within this budget
+	bool Numa;							// Pin concurrent images to NUMA nodes
+	unsigned int BinSize;				// Side of the lines bins, 32, 64 and 128 run kernels compiled for them
+	unsigned int ThinLinesRadius;		// Radius of the disk removing thin lines, 4, 8 and 12 use precomputed disks
+	std::string ResultsFileName;
+};
+
+bool GetImageFileListFromDir(const std::string& InputDir, const std::string& FileType, std::vector<std::string>& ImageFileNames);
+bool IsImageFileName(const std::string& FileName, const std::string& FileType);
+bool ProcessImage(const std::string& ImageFileName, const ProcessingOptions& Options, std::map<std::string, double>& Results);
+// Decodes the TIFF held in Data, ImageName is used in messages and SavePrefix starts the names of saved images
+bool ProcessImage(const std::string& ImageName, const std::string& SavePrefix, const unsigned char* Data, size_t DataSize,
+				  const ProcessingOptions& Options, std::map<std::string, double>& Results);
+// CSV fields are quoted only when they hold separators or quotes
+std::string QuoteCsvField(const std::string& Field);
+std::string GetResultsHeader();
+std::string GetResultsLine(const std::string& ImageFileName, const std::map<std::string, double>& Results);
+bool WriteValidationReport(const std::string& ReportFileName, const std::vector<std::string>& ImageFileNames,
+						   const std::map<unsigned int, std::map<std::string, double> >& MapResults);
+bool MergeResultsFiles(const std::string& OutputFileName, const std::vector<std::string>& ShardFileNames);
+
+#endif
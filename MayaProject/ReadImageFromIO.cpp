@@ -2,7 +2,9 @@
 
 #include "tiffio.h"
 #include "ipp.h"
+#include "BufferPool.h"
 #include <math.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -16,20 +18,81 @@ template bool WritePgmFile<unsigned int>(const string&,const unsigned int*,unsig
 template bool WritePgmFile<float>(const string&,const float*,unsigned int,unsigned int,unsigned int);
 template bool WritePgmFile<double>(const string&,const double*,unsigned int,unsigned int,unsigned int);
 
-unsigned char* ReadImageTIF(const string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep) {
+// Read only stream over a TIFF held in memory, used through libtiff's client procedures
+struct MemoryStream {
+	const unsigned char* Data;
+	toff_t Size;
+	toff_t Position;
+};
+
+tsize_t MemoryStreamRead(thandle_t Handle, tdata_t Buffer, tsize_t Size) {
+	MemoryStream* Stream = (MemoryStream*)Handle;
+	tsize_t NumberOfBytes = (tsize_t)min((toff_t)Size, Stream->Size - min(Stream->Position, Stream->Size));
+	memcpy(Buffer, Stream->Data + Stream->Position, NumberOfBytes);
+	Stream->Position += NumberOfBytes;
+	return NumberOfBytes;
+}
 
-	//Initialize output variables
-	ImageWidth = 0;
-	ImageHeight = 0;
-	ImageByteStep = 0;
+tsize_t MemoryStreamWrite(thandle_t Handle, tdata_t Buffer, tsize_t Size) {
+	return 0;
+}
 
-	// Set warning handler
-	TIFFSetWarningHandler(NULL);
+toff_t MemoryStreamSeek(thandle_t Handle, toff_t Offset, int Whence) {
+	MemoryStream* Stream = (MemoryStream*)Handle;
+	if (Whence == SEEK_CUR)
+		Offset += Stream->Position;
+	else if (Whence == SEEK_END)
+		Offset += Stream->Size;
+	Stream->Position = Offset;
+	return Stream->Position;
+}
 
-	// Initialize tiff image pointer
-	TIFF* InputImage = TIFFOpen(InputFileName.c_str(), "r");
-	if (!InputImage) {
-		printf("ReadImageTIF failed to open file %s\n", InputFileName.c_str());
+int MemoryStreamClose(thandle_t Handle) {
+	delete (MemoryStream*)Handle;
+	return 0;
+}
+
+toff_t MemoryStreamSize(thandle_t Handle) {
+	return ((MemoryStream*)Handle)->Size;
+}
+
+// Mapping hands libtiff the buffer itself so uncompressed strips are not copied
+int MemoryStreamMap(thandle_t Handle, tdata_t* Base, toff_t* Size) {
+	*Base = (tdata_t)((MemoryStream*)Handle)->Data;
+	*Size = ((MemoryStream*)Handle)->Size;
+	return 1;
+}
+
+void MemoryStreamUnmap(thandle_t Handle, tdata_t Base, toff_t Size) {
+}
+
+TIFF* OpenTIFF(const string& InputFileName, const unsigned char* Data, size_t DataSize) {
+
+	// Open file from disk
+	if (!Data)
+		return TIFFOpen(InputFileName.c_str(), "r");
+
+	// Open memory buffer, the stream is released by MemoryStreamClose
+	MemoryStream* Stream = new MemoryStream;
+	Stream->Data = Data;
+	Stream->Size = (toff_t)DataSize;
+	Stream->Position = 0;
+	TIFF* Image = TIFFClientOpen(InputFileName.c_str(), "r", (thandle_t)Stream,
+								 MemoryStreamRead, MemoryStreamWrite, MemoryStreamSeek, MemoryStreamClose,
+								 MemoryStreamSize, MemoryStreamMap, MemoryStreamUnmap);
+	if (!Image)
+		delete Stream;
+
+	return Image;
+}
+
+// Decodes an opened TIFF to 8 bits and closes it
+unsigned char* DecodeImageTIF(TIFF* InputImage, const string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep) {
+
+	// Strips are read below, tiles only by the 16 bit path
+	if (TIFFIsTiled(InputImage)) {
+		printf("ReadImageTIF can not read tiled image %s, only single channel 16 bit tiled images are read with Native16\n", InputFileName.c_str());
+		TIFFClose(InputImage);
 		return NULL;
 	}
 
@@ -42,18 +105,25 @@ unsigned char* ReadImageTIF(const string& InputFileName, unsigned int& ImageWidt
 	TIFFGetField(InputImage, TIFFTAG_IMAGELENGTH, &ImageHeight);
 	const unsigned int StripSize = TIFFStripSize(InputImage);
 	const unsigned int NumberOfStrips = TIFFNumberOfStrips(InputImage);
+	const unsigned int ScanlineSize = TIFFScanlineSize(InputImage);
 	TIFFGetField(InputImage, TIFFTAG_TILEWIDTH, &TileWidth);
 	TIFFGetField(InputImage, TIFFTAG_TILELENGTH, &TileHeight);
 
 	// Check validity of header parameters
-	if ((ImageWidth == 0) || (ImageHeight == 0) || (NumberOfChannels == 0) || (NumberOfBitsPerChannel == 0) || (StripSize == 0) || (NumberOfStrips == 0)) {
+	if ((ImageWidth == 0) || (ImageHeight == 0) || (NumberOfChannels == 0) || ((NumberOfBitsPerChannel != 8) && (NumberOfBitsPerChannel != 16)) ||
+		(StripSize == 0) || (NumberOfStrips == 0) || (ScanlineSize < ImageWidth * NumberOfChannels * (NumberOfBitsPerChannel / 8))) {
 		printf("ReadImageTIF found invalid parameters in image %s header\n", InputFileName.c_str());
 		TIFFClose(InputImage);
 		return NULL;
 	}
 
-	// Calculate number of rows per strip
-	const unsigned int NumberOfRowsPerStrip = StripSize / ImageWidth / NumberOfChannels / (NumberOfBitsPerChannel / 8);
+	// Calculate number of rows per strip, the strips must cover the image
+	const unsigned int NumberOfRowsPerStrip = StripSize / ScanlineSize;
+	if ((NumberOfRowsPerStrip == 0) || ((unsigned long long)NumberOfRowsPerStrip * NumberOfStrips < ImageHeight)) {
+		printf("ReadImageTIF found strips not covering image %s\n", InputFileName.c_str());
+		TIFFClose(InputImage);
+		return NULL;
+	}
 
 	// Allocate strip buffer
 	unsigned char* StripBuffer = ippsMalloc_8u(StripSize);
@@ -63,8 +133,8 @@ unsigned char* ReadImageTIF(const string& InputFileName, unsigned int& ImageWidt
 		return NULL;
 	}
 
-	// Allocate output image
-	unsigned char* OutputImage = ippiMalloc_8u_C1(ImageWidth, ImageHeight, &ImageByteStep);
+	// Allocate output image, pooled buffers hold the previous image so every row is written below
+	unsigned char* OutputImage = PoolMalloc_8u_C1(ImageWidth, ImageHeight, &ImageByteStep);
 	if (!OutputImage) {
 		printf("ReadImageTIF failed to allocate output image buffer of size %u [Bytes]", ImageHeight*ImageByteStep);
 		TIFFClose(InputImage);
@@ -72,30 +142,30 @@ unsigned char* ReadImageTIF(const string& InputFileName, unsigned int& ImageWidt
 		return NULL;
 	}
 
-	// Read and copy data
-	for (unsigned int Cnt1 = 0, BufferOffset = 0; Cnt1 < NumberOfStrips; ++Cnt1){
+	// Read and copy data, multi channel images keep their first channel and 16 bit images their upper 8 bits
+	for (unsigned int Cnt1 = 0; Cnt1 * NumberOfRowsPerStrip < ImageHeight; ++Cnt1){
+		const unsigned int NumberOfRows = min(NumberOfRowsPerStrip, ImageHeight - Cnt1 * NumberOfRowsPerStrip);
 		int NumberOfBytesRead = TIFFReadEncodedStrip(InputImage, Cnt1, StripBuffer, StripSize);
-		if (NumberOfBytesRead == -1) {
+		if ((NumberOfBytesRead == -1) || ((unsigned int)NumberOfBytesRead < NumberOfRows * ScanlineSize)) {
 			printf("ReadImageTIF failed to read strip %u from input image", Cnt1);
 			TIFFClose(InputImage);
 			ippsFree(StripBuffer);
-			ippiFree(OutputImage);
+			PoolFree(OutputImage);
 			return NULL;
 		}
-		unsigned char* ImageRow = OutputImage + Cnt1 * NumberOfRowsPerStrip * ImageByteStep;
-		if (NumberOfChannels == 1) {
-			if (NumberOfBitsPerChannel == 8) {
-				memcpy(ImageRow, StripBuffer, ImageWidth*sizeof(unsigned char));
+		for (unsigned int Cnt2 = 0; Cnt2 < NumberOfRows; ++Cnt2) {
+			const unsigned char* StripRow = StripBuffer + Cnt2 * ScanlineSize;
+			unsigned char* ImageRow = OutputImage + (Cnt1 * NumberOfRowsPerStrip + Cnt2) * ImageByteStep;
+			if ((NumberOfChannels == 1) && (NumberOfBitsPerChannel == 8)) {
+				memcpy(ImageRow, StripRow, ImageWidth*sizeof(unsigned char));
 			}
-			else if (NumberOfBitsPerChannel == 16) {
-				for (unsigned int Cnt2 = 0; Cnt2 < (StripSize / (NumberOfBitsPerChannel / 8)); ++Cnt2) {
-					ImageRow[Cnt2] = (unsigned char)(((unsigned short*)StripBuffer)[Cnt2] >> 8);
-				}
+			else if (NumberOfBitsPerChannel == 8) {
+				for (unsigned int Cnt3 = 0; Cnt3 < ImageWidth; ++Cnt3)
+					ImageRow[Cnt3] = StripRow[Cnt3 * NumberOfChannels];
 			}
-		}
-		else if (NumberOfChannels == 3) {			
-			for (unsigned int Cnt2 = 0, Cnt3 = Cnt2 * NumberOfChannels; Cnt2 < StripSize; Cnt2 += NumberOfChannels, ++Cnt3) {
-				ImageRow[Cnt3] = StripBuffer[Cnt2 + 0];
+			else {
+				for (unsigned int Cnt3 = 0; Cnt3 < ImageWidth; ++Cnt3)
+					ImageRow[Cnt3] = (unsigned char)(((const unsigned short*)StripRow)[Cnt3 * NumberOfChannels] >> 8);
 			}
 		}
 	}
@@ -109,6 +179,181 @@ unsigned char* ReadImageTIF(const string& InputFileName, unsigned int& ImageWidt
 	// Return output image
 	return OutputImage;
 }
+
+// Decodes an opened single channel 16 bit TIFF at full depth and closes it
+unsigned short* DecodeImageTIF16(TIFF* InputImage, const string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep) {
+
+	// Get tiff image parameters
+	unsigned short NumberOfBitsPerChannel = 0, NumberOfChannels = 0;
+	TIFFGetField(InputImage, TIFFTAG_BITSPERSAMPLE, &NumberOfBitsPerChannel);
+	TIFFGetField(InputImage, TIFFTAG_SAMPLESPERPIXEL, &NumberOfChannels);
+	TIFFGetField(InputImage, TIFFTAG_IMAGEWIDTH, &ImageWidth);
+	TIFFGetField(InputImage, TIFFTAG_IMAGELENGTH, &ImageHeight);
+
+	// Only single channel 16 bit images are read at full depth
+	if ((ImageWidth == 0) || (ImageHeight == 0) || (NumberOfChannels != 1) || (NumberOfBitsPerChannel != 16)) {
+		printf("ReadImageTIF16 found unsupported parameters in image %s header\n", InputFileName.c_str());
+		TIFFClose(InputImage);
+		return NULL;
+	}
+
+	// Allocate output image
+	unsigned short* OutputImage = PoolMalloc_16u_C1(ImageWidth, ImageHeight, &ImageByteStep);
+	if (!OutputImage) {
+		printf("ReadImageTIF16 failed to allocate output image buffer of size %u [Bytes]", ImageHeight*ImageByteStep);
+		TIFFClose(InputImage);
+		return NULL;
+	}
+
+	// Decode rows directly into the output image, no strip buffer or conversion pass is needed
+	if (!TIFFIsTiled(InputImage)) {
+		for (unsigned int Cnt1 = 0; Cnt1 < ImageHeight; ++Cnt1) {
+			if (TIFFReadScanline(InputImage, (unsigned char*)OutputImage + Cnt1 * ImageByteStep, Cnt1, 0) == -1) {
+				printf("ReadImageTIF16 failed to read row %u from input image", Cnt1);
+				TIFFClose(InputImage);
+				PoolFree(OutputImage);
+				return NULL;
+			}
+		}
+		TIFFClose(InputImage);
+		return OutputImage;
+	}
+
+	// Tiled images are decoded tile by tile and copied, edge tiles are clipped to the image
+	unsigned int TileWidth = 0, TileHeight = 0;
+	TIFFGetField(InputImage, TIFFTAG_TILEWIDTH, &TileWidth);
+	TIFFGetField(InputImage, TIFFTAG_TILELENGTH, &TileHeight);
+	const unsigned int TileSize = TIFFTileSize(InputImage);
+	unsigned char* TileBuffer = (TileSize >= TileWidth * TileHeight * sizeof(unsigned short)) ? ippsMalloc_8u(TileSize) : NULL;
+	if ((TileWidth == 0) || (TileHeight == 0) || !TileBuffer) {
+		printf("ReadImageTIF16 failed to allocate tile buffer for image %s\n", InputFileName.c_str());
+		TIFFClose(InputImage);
+		PoolFree(OutputImage);
+		if (TileBuffer)
+			ippsFree(TileBuffer);
+		return NULL;
+	}
+	for (unsigned int Cnt1 = 0; Cnt1 < ImageHeight; Cnt1 += TileHeight) {
+		for (unsigned int Cnt2 = 0; Cnt2 < ImageWidth; Cnt2 += TileWidth) {
+			if (TIFFReadTile(InputImage, TileBuffer, Cnt2, Cnt1, 0, 0) == -1) {
+				printf("ReadImageTIF16 failed to read tile at %u,%u from input image", Cnt2, Cnt1);
+				TIFFClose(InputImage);
+				PoolFree(OutputImage);
+				ippsFree(TileBuffer);
+				return NULL;
+			}
+			const unsigned int NumberOfRows = min(TileHeight, ImageHeight - Cnt1);
+			const unsigned int NumberOfColumns = min(TileWidth, ImageWidth - Cnt2);
+			for (unsigned int Cnt3 = 0; Cnt3 < NumberOfRows; ++Cnt3)
+				memcpy((unsigned char*)OutputImage + (Cnt1 + Cnt3) * ImageByteStep + Cnt2 * sizeof(unsigned short),
+					   TileBuffer + Cnt3 * TileWidth * sizeof(unsigned short), NumberOfColumns * sizeof(unsigned short));
+		}
+	}
+
+	// Free buffers
+	TIFFClose(InputImage);
+	ippsFree(TileBuffer);
+
+	// Return output image
+	return OutputImage;
+}
+
+unsigned char* ReadImageTIF(const string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep, const unsigned char* Data, size_t DataSize) {
+
+	//Initialize output variables
+	ImageWidth = 0;
+	ImageHeight = 0;
+	ImageByteStep = 0;
+
+	// Set warning handler
+	TIFFSetWarningHandler(NULL);
+
+	// Initialize tiff image pointer
+	TIFF* InputImage = OpenTIFF(InputFileName, Data, DataSize);
+	if (!InputImage) {
+		printf("ReadImageTIF failed to open file %s\n", InputFileName.c_str());
+		return NULL;
+	}
+
+	return DecodeImageTIF(InputImage, InputFileName, ImageWidth, ImageHeight, ImageByteStep);
+}
+
+unsigned short* ReadImageTIF16(const string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep, const unsigned char* Data, size_t DataSize) {
+
+	//Initialize output variables
+	ImageWidth = 0;
+	ImageHeight = 0;
+	ImageByteStep = 0;
+
+	// Set warning handler
+	TIFFSetWarningHandler(NULL);
+
+	// Initialize tiff image pointer
+	TIFF* InputImage = OpenTIFF(InputFileName, Data, DataSize);
+	if (!InputImage) {
+		printf("ReadImageTIF16 failed to open file %s\n", InputFileName.c_str());
+		return NULL;
+	}
+
+	return DecodeImageTIF16(InputImage, InputFileName, ImageWidth, ImageHeight, ImageByteStep);
+}
+
+bool ReadImageTIFAnyDepth(const string& InputFileName, bool Native16, unsigned char*& Image8, unsigned short*& Image16,
+						  unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep, const unsigned char* Data, size_t DataSize) {
+
+	//Initialize output variables
+	Image8 = NULL;
+	Image16 = NULL;
+	ImageWidth = 0;
+	ImageHeight = 0;
+	ImageByteStep = 0;
+
+	// Set warning handler
+	TIFFSetWarningHandler(NULL);
+
+	// Open image once, its header selects the decoder
+	TIFF* InputImage = OpenTIFF(InputFileName, Data, DataSize);
+	if (!InputImage) {
+		printf("ReadImageTIF failed to open file %s\n", InputFileName.c_str());
+		return false;
+	}
+	unsigned short NumberOfBitsPerChannel = 0, NumberOfChannels = 0;
+	TIFFGetField(InputImage, TIFFTAG_BITSPERSAMPLE, &NumberOfBitsPerChannel);
+	TIFFGetField(InputImage, TIFFTAG_SAMPLESPERPIXEL, &NumberOfChannels);
+	if (Native16 && (NumberOfBitsPerChannel == 16) && (NumberOfChannels == 1))
+		Image16 = DecodeImageTIF16(InputImage, InputFileName, ImageWidth, ImageHeight, ImageByteStep);
+	else
+		Image8 = DecodeImageTIF(InputImage, InputFileName, ImageWidth, ImageHeight, ImageByteStep);
+
+	return Image8 || Image16;
+}
+
+bool ReadImageTIFHeader(const string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, unsigned short& NumberOfBitsPerChannel, unsigned short& NumberOfChannels, const unsigned char* Data, size_t DataSize) {
+
+	//Initialize output variables
+	ImageWidth = 0;
+	ImageHeight = 0;
+	NumberOfBitsPerChannel = 0;
+	NumberOfChannels = 0;
+
+	// Set warning handler
+	TIFFSetWarningHandler(NULL);
+
+	// Open image, only the directory is read
+	TIFF* InputImage = OpenTIFF(InputFileName, Data, DataSize);
+	if (!InputImage) {
+		printf("ReadImageTIFHeader failed to open file %s\n", InputFileName.c_str());
+		return false;
+	}
+	TIFFGetField(InputImage, TIFFTAG_BITSPERSAMPLE, &NumberOfBitsPerChannel);
+	TIFFGetField(InputImage, TIFFTAG_SAMPLESPERPIXEL, &NumberOfChannels);
+	TIFFGetField(InputImage, TIFFTAG_IMAGEWIDTH, &ImageWidth);
+	TIFFGetField(InputImage, TIFFTAG_IMAGELENGTH, &ImageHeight);
+	TIFFClose(InputImage);
+
+	return (ImageWidth != 0) && (ImageHeight != 0) && (NumberOfBitsPerChannel != 0) && (NumberOfChannels != 0);
+}
+
 /*
 unsigned char* ReadImageTIF(const string& InputFileName,unsigned int& Width,unsigned int& Height,int& ByteStep) {
 
@@ -295,4 +540,171 @@ template <class T> bool WritePgmFile(const string& FileName,const T* Image,unsig
 	fclose(PgmFileStream);
 
 	return true;
-}
\ No newline at end of file
+}
+
+// Grid file identification and layout
+static const char BinGridMagic[8]={'M','A','Y','A','G','R','I','D'};
+static const unsigned int BinGridVersion=1;
+static const unsigned int BinGridHasCircles=1;
+static_assert(sizeof(BinRecord) == 20, "BinRecord is written to grid files as is");
+
+bool WriteBinGridFile(const string& FileName, const BinGrid& Grid) {
+
+	// Open file for writing
+	FILE* GridFileStream=NULL;
+	if(fopen_s(&GridFileStream,FileName.c_str(),"wb")) {
+		printf("WriteBinGridFile failed to open file %s\n",FileName.c_str());
+		return false;
+	}
+
+	// Write header and bins
+	unsigned int Header[7]={BinGridVersion,Grid.HasCircles ? BinGridHasCircles : 0,Grid.Width,Grid.Height,Grid.BinSize,Grid.NumberOfBinsX,Grid.NumberOfBinsY};
+	bool Status=(fwrite(BinGridMagic,1,sizeof(BinGridMagic),GridFileStream) == sizeof(BinGridMagic)) &&
+				(fwrite(Header,sizeof(unsigned int),7,GridFileStream) == 7) &&
+				(Grid.Bins.empty() || (fwrite(&Grid.Bins[0],sizeof(BinRecord),Grid.Bins.size(),GridFileStream) == Grid.Bins.size()));
+	if(!Status)
+		printf("WriteBinGridFile failed to write grid to file %s\n",FileName.c_str());
+
+	// Close file
+	fclose(GridFileStream);
+
+	return Status;
+}
+
+bool ReadBinGridFile(const string& FileName, BinGrid& Grid) {
+
+	// Open file for reading
+	FILE* GridFileStream=NULL;
+	if(fopen_s(&GridFileStream,FileName.c_str(),"rb")) {
+		printf("ReadBinGridFile failed to open file %s\n",FileName.c_str());
+		return false;
+	}
+
+	// Read and check header
+	char Magic[8];
+	unsigned int Header[7];
+	if((fread(Magic,1,sizeof(Magic),GridFileStream) != sizeof(Magic)) || memcmp(Magic,BinGridMagic,sizeof(Magic)) ||
+	   (fread(Header,sizeof(unsigned int),7,GridFileStream) != 7) || (Header[0] != BinGridVersion)) {
+		printf("ReadBinGridFile found unknown header in %s\n",FileName.c_str());
+		fclose(GridFileStream);
+		return false;
+	}
+	Grid.HasCircles=(Header[1] & BinGridHasCircles) != 0;
+	Grid.Width=Header[2];
+	Grid.Height=Header[3];
+	Grid.BinSize=Header[4];
+	Grid.NumberOfBinsX=Header[5];
+	Grid.NumberOfBinsY=Header[6];
+
+	// Read bins
+	Grid.Bins.resize((size_t)Grid.NumberOfBinsX*Grid.NumberOfBinsY);
+	bool Status=Grid.Bins.empty() || (fread(&Grid.Bins[0],sizeof(BinRecord),Grid.Bins.size(),GridFileStream) == Grid.Bins.size());
+	if(!Status)
+		printf("ReadBinGridFile failed to read bins from %s\n",FileName.c_str());
+
+	// Close file
+	fclose(GridFileStream);
+
+	return Status;
+}
+
+// Reads a single channel 8 or 16 bit mask TIFF row by row, whatever its strip layout, into one byte per pixel
+// that is non zero inside
+bool ReadMaskTIF(const string& FileName, unsigned int& MaskWidth, unsigned int& MaskHeight, vector<unsigned char>& Mask) {
+
+	// Open mask
+	TIFFSetWarningHandler(NULL);
+	TIFF* MaskImage = OpenTIFF(FileName, NULL, 0);
+	if (!MaskImage) {
+		printf("ReadRoiFile failed to open mask %s\n", FileName.c_str());
+		return false;
+	}
+
+	// Get tiff image parameters
+	unsigned short NumberOfBitsPerChannel = 0, NumberOfChannels = 0;
+	MaskWidth = 0;
+	MaskHeight = 0;
+	TIFFGetField(MaskImage, TIFFTAG_BITSPERSAMPLE, &NumberOfBitsPerChannel);
+	TIFFGetField(MaskImage, TIFFTAG_SAMPLESPERPIXEL, &NumberOfChannels);
+	TIFFGetField(MaskImage, TIFFTAG_IMAGEWIDTH, &MaskWidth);
+	TIFFGetField(MaskImage, TIFFTAG_IMAGELENGTH, &MaskHeight);
+	if ((MaskWidth == 0) || (MaskHeight == 0) || (NumberOfChannels != 1) || ((NumberOfBitsPerChannel != 8) && (NumberOfBitsPerChannel != 16))) {
+		printf("ReadRoiFile found unsupported parameters in mask %s header, masks are single channel 8 or 16 bit\n", FileName.c_str());
+		TIFFClose(MaskImage);
+		return false;
+	}
+
+	// Decode rows, 16 bit rows are reduced to their non zero pixels
+	const unsigned int BytesPerPixel = NumberOfBitsPerChannel / 8;
+	vector<unsigned char> Scanline((size_t)MaskWidth * BytesPerPixel);
+	Mask.resize((size_t)MaskWidth * MaskHeight);
+	for (unsigned int Cnt1 = 0; Cnt1 < MaskHeight; ++Cnt1) {
+		if (TIFFReadScanline(MaskImage, &Scanline[0], Cnt1, 0) == -1) {
+			printf("ReadRoiFile failed to read row %u from mask %s\n", Cnt1, FileName.c_str());
+			TIFFClose(MaskImage);
+			return false;
+		}
+		unsigned char* MaskLine = &Mask[(size_t)Cnt1 * MaskWidth];
+		if (BytesPerPixel == 1) {
+			memcpy(MaskLine, &Scanline[0], MaskWidth);
+		}
+		else {
+			const unsigned short* ScanlineValues = (const unsigned short*)&Scanline[0];
+			for (unsigned int Cnt2 = 0; Cnt2 < MaskWidth; ++Cnt2)
+				MaskLine[Cnt2] = (ScanlineValues[Cnt2] != 0) ? 255 : 0;
+		}
+	}
+	TIFFClose(MaskImage);
+
+	return true;
+}
+
+bool ReadRoiFile(const string& FileName, unsigned int ImageWidth, unsigned int ImageHeight, RoiMask& Roi) {
+
+	// Mask images must match the image they restrict
+	if((FileName.size() < 4) || (FileName.substr(FileName.size()-4) != ".txt")) {
+		unsigned int MaskWidth=0,MaskHeight=0;
+		vector<unsigned char> Mask;
+		if(!ReadMaskTIF(FileName,MaskWidth,MaskHeight,Mask))
+			return false;
+		if((MaskWidth != ImageWidth) || (MaskHeight != ImageHeight)) {
+			printf("ReadRoiFile found mask %s of size %ux%u for image of size %ux%u\n",FileName.c_str(),MaskWidth,MaskHeight,ImageWidth,ImageHeight);
+			return false;
+		}
+		return Roi.CreateFromMask(&Mask[0],MaskWidth,MaskWidth,MaskHeight);
+	}
+
+	// Open polygon file
+	FILE* RoiFileStream=NULL;
+	if(fopen_s(&RoiFileStream,FileName.c_str(),"rb")) {
+		printf("ReadRoiFile failed to open file %s\n",FileName.c_str());
+		return false;
+	}
+
+	// Read vertices, an empty line closes the current polygon
+	vector<vector<pair<double, double> > > Polygons(1);
+	char Line[256];
+	bool Status=true;
+	while(fgets(Line,sizeof(Line),RoiFileStream)) {
+		if(Line[0] == '#')
+			continue;
+		double X=0.0,Y=0.0;
+		if(sscanf_s(Line," %lf%*[ ,\t]%lf",&X,&Y) == 2) {
+			Polygons.back().push_back(make_pair(X,Y));
+		}
+		else if(strspn(Line," \t\r\n") == strlen(Line)) {
+			if(!Polygons.back().empty())
+				Polygons.push_back(vector<pair<double, double> >());
+		}
+		else {
+			printf("ReadRoiFile found invalid line in %s: %s\n",FileName.c_str(),Line);
+			Status=false;
+			break;
+		}
+	}
+	fclose(RoiFileStream);
+	if(!Status)
+		return false;
+
+	return Roi.CreateFromPolygons(Polygons,ImageWidth,ImageHeight);
+}
@@ -1,4 +1,19 @@
 #include <string>
+#include "Algorithms.h"
 
-unsigned char* ReadImageTIF(const std::string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep);
+// When Data is given the TIFF is decoded from that memory buffer and InputFileName only names it in messages
+unsigned char* ReadImageTIF(const std::string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep, const unsigned char* Data = NULL, size_t DataSize = 0);
+unsigned short* ReadImageTIF16(const std::string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep, const unsigned char* Data = NULL, size_t DataSize = 0);
+// Opens the TIFF once and reads it at full depth into Image16 when Native16 is set and it is single channel 16 bit,
+// otherwise to 8 bits into Image8, the other one is NULL
+bool ReadImageTIFAnyDepth(const std::string& InputFileName, bool Native16, unsigned char*& Image8, unsigned short*& Image16,
+						  unsigned int& ImageWidth, unsigned int& ImageHeight, int& ImageByteStep, const unsigned char* Data = NULL, size_t DataSize = 0);
+bool ReadImageTIFHeader(const std::string& InputFileName, unsigned int& ImageWidth, unsigned int& ImageHeight, unsigned short& NumberOfBitsPerChannel, unsigned short& NumberOfChannels, const unsigned char* Data = NULL, size_t DataSize = 0);
+// Grid files hold a 36 byte header ("MAYAGRID", version, flags, width, height, bin size, bins in X and Y,
+// all unsigned 32 bit little endian) followed by one BinRecord per bin in row major order
+bool WriteBinGridFile(const std::string& FileName, const BinGrid& Grid);
+bool ReadBinGridFile(const std::string& FileName, BinGrid& Grid);
+// ROI files are either a TIFF mask of the image's size, non zero pixels inside, or a text file (*.txt) of polygons
+// with one "x y" vertex in pixel coordinates per line, polygons separated by empty lines and lines starting with # ignored
+bool ReadRoiFile(const std::string& FileName, unsigned int ImageWidth, unsigned int ImageHeight, RoiMask& Roi);
 template <class T> bool WritePgmFile(const std::string& FileName,const T* Image,unsigned int Width,unsigned int Height,unsigned int ByteStep);
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "Roi.h"
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+RoiMask::RoiMask() : Width(0), Height(0), RowOffsets(1,0) {
+}
+
+void RoiMask::AddSpan(unsigned int StartX,unsigned int EndX) {
+
+	// Spans of a row arrive sorted, touching or overlapping spans are merged
+	if((Spans.size() > RowOffsets.back()) && (StartX <= Spans.back().second)) {
+		Spans.back().second=max(Spans.back().second,EndX);
+		return;
+	}
+	Spans.push_back(make_pair(StartX,EndX));
+}
+
+bool RoiMask::CreateFromMask(const unsigned char* Mask,unsigned int MaskByteStep,unsigned int Width,unsigned int Height) {
+
+	this->Width=Width;
+	this->Height=Height;
+	RowOffsets.assign(1,0);
+	Spans.clear();
+	if(!Mask)
+		return false;
+
+	// Collect runs of non zero pixels
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		const unsigned char* MaskLine=Mask+Cnt1*MaskByteStep;
+		unsigned int Cnt2=0;
+		while(Cnt2 < Width) {
+			while((Cnt2 < Width) && !MaskLine[Cnt2])
+				Cnt2++;
+			unsigned int StartX=Cnt2;
+			while((Cnt2 < Width) && MaskLine[Cnt2])
+				Cnt2++;
+			if(Cnt2 > StartX)
+				AddSpan(StartX,Cnt2);
+		}
+		RowOffsets.push_back((unsigned int)Spans.size());
+	}
+
+	return true;
+}
+
+bool RoiMask::CreateFromPolygons(const vector<vector<pair<double, double> > >& Polygons,unsigned int Width,unsigned int Height) {
+
+	this->Width=Width;
+	this->Height=Height;
+	RowOffsets.assign(1,0);
+	Spans.clear();
+
+	// Scan each row at the pixel centers
+	vector<double> Crossings;
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		double Y=Cnt1+0.5;
+
+		// Find where polygon edges cross the row
+		Crossings.clear();
+		for(unsigned int Cnt2=0;Cnt2<Polygons.size();Cnt2++) {
+			const vector<pair<double, double> >& Points=Polygons[Cnt2];
+			for(unsigned int Cnt3=0;Cnt3<Points.size();Cnt3++) {
+				const pair<double, double>& P1=Points[Cnt3];
+				const pair<double, double>& P2=Points[(Cnt3+1)%Points.size()];
+				if((P1.second <= Y) != (P2.second <= Y))
+					Crossings.push_back(P1.first+(Y-P1.second)*(P2.first-P1.first)/(P2.second-P1.second));
+			}
+		}
+		sort(Crossings.begin(),Crossings.end());
+
+		// Pixels whose centers lie between pairs of crossings are inside
+		for(unsigned int Cnt2=0;Cnt2+1<Crossings.size();Cnt2+=2) {
+			double StartX=max(0.0,ceil(Crossings[Cnt2]-0.5));
+			double EndX=min((double)Width,ceil(Crossings[Cnt2+1]-0.5));
+			if(EndX > StartX)
+				AddSpan((unsigned int)StartX,(unsigned int)EndX);
+		}
+		RowOffsets.push_back((unsigned int)Spans.size());
+	}
+
+	return true;
+}
+
+double RoiMask::GetArea() const {
+
+	double Area=0.0;
+	for(unsigned int Cnt1=0;Cnt1<Spans.size();Cnt1++)
+		Area+=Spans[Cnt1].second-Spans[Cnt1].first;
+
+	return Area;
+}
+
+unsigned int RoiMask::GetAreaInRect(unsigned int StartX,unsigned int StartY,unsigned int RectWidth,unsigned int RectHeight) const {
+
+	unsigned int Area=0;
+	unsigned int EndX=StartX+RectWidth;
+	for(unsigned int Cnt1=StartY;(Cnt1<StartY+RectHeight) && (Cnt1<Height);Cnt1++) {
+		for(unsigned int Cnt2=RowOffsets[Cnt1];Cnt2<RowOffsets[Cnt1+1];Cnt2++) {
+			unsigned int SpanStart=max(StartX,Spans[Cnt2].first);
+			unsigned int SpanEnd=min(EndX,Spans[Cnt2].second);
+			if(SpanEnd > SpanStart)
+				Area+=SpanEnd-SpanStart;
+		}
+	}
+
+	return Area;
+}
+
+void RoiMask::Apply(unsigned char* Image,unsigned int ByteStep) const {
+
+	// Clear the gaps between spans
+	for(unsigned int Cnt1=0;Cnt1<Height;Cnt1++) {
+		unsigned char* ImageLine=Image+Cnt1*ByteStep;
+		unsigned int StartX=0;
+		for(unsigned int Cnt2=RowOffsets[Cnt1];Cnt2<RowOffsets[Cnt1+1];Cnt2++) {
+			memset(ImageLine+StartX,0,Spans[Cnt2].first-StartX);
+			StartX=Spans[Cnt2].second;
+		}
+		memset(ImageLine+StartX,0,Width-StartX);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <vector>
+#include <utility>
+
+// Region of interest stored as sorted, non overlapping [StartX,EndX) spans per row
+class RoiMask {
+public:
+	RoiMask();
+
+	// Build from a mask image (non zero pixels are inside) or from polygons given in pixel coordinates,
+	// a pixel is inside a polygon when its center is (even-odd rule)
+	bool CreateFromMask(const unsigned char* Mask,unsigned int MaskByteStep,unsigned int Width,unsigned int Height);
+	bool CreateFromPolygons(const std::vector<std::vector<std::pair<double, double> > >& Polygons,unsigned int Width,unsigned int Height);
+
+	unsigned int GetWidth() const { return Width; }
+	unsigned int GetHeight() const { return Height; }
+	bool IsRowEmpty(unsigned int Y) const { return RowOffsets[Y] == RowOffsets[Y+1]; }
+	unsigned int GetNumberOfSpans(unsigned int Y) const { return RowOffsets[Y+1]-RowOffsets[Y]; }
+	const std::pair<unsigned int, unsigned int>* GetSpans(unsigned int Y) const { return Spans.empty() ? NULL : &Spans[RowOffsets[Y]]; }
+
+	// Number of ROI pixels in the whole image and in a rectangle
+	double GetArea() const;
+	unsigned int GetAreaInRect(unsigned int StartX,unsigned int StartY,unsigned int RectWidth,unsigned int RectHeight) const;
+
+	// Set pixels outside the ROI to zero
+	void Apply(unsigned char* Image,unsigned int ByteStep) const;
+
+private:
+	void AddSpan(unsigned int StartX,unsigned int EndX);
+
+	unsigned int Width;
+	unsigned int Height;
+	std::vector<unsigned int> RowOffsets;
+	std::vector<std::pair<unsigned int, unsigned int> > Spans;
+};
+
+#endif
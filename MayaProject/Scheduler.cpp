@@ -0,0 +1,225 @@
+#include "Scheduler.h"
+#include "ReadImageFromIO.h"
+#include "Algorithms.h"
+#include "BufferPool.h"
+
+#include <Windows.h>
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+bool EstimateImageNeeds(const string& ImageFileName, const ProcessingOptions& Options, unsigned long long& Memory, double& Cost) {
+
+	Memory=0;
+	Cost=0.0;
+
+	// Read size only
+	unsigned int ImageWidth=0,ImageHeight=0;
+	unsigned short BitsPerChannel=0,NumberOfChannels=0;
+	if(!ReadImageTIFHeader(ImageFileName,ImageWidth,ImageHeight,BitsPerChannel,NumberOfChannels))
+		return false;
+	unsigned long long NumberOfPixels=(unsigned long long)ImageWidth*ImageHeight;
+
+	// Input image, 16 bit only when analysed at full depth
+	unsigned long long InputPlanes=(Options.Native16 && (BitsPerChannel == 16) && (NumberOfChannels == 1)) ? 2 : 1;
+	unsigned long long NumberOfPlanes=InputPlanes;
+
+	// ROI mask read from file
+	if(Options.Roi)
+		NumberOfPlanes++;
+
+	// Background corrected copy of the input
+	if(Options.BackgroundRadius)
+		NumberOfPlanes+=InputPlanes;
+
+	// Lines mask, exact mask for validation, circles mask and the double height thin lines morphology buffer
+	if(Options.LinesAlgorithm)
+		NumberOfPlanes++;
+	if(Options.LinesAlgorithm && Options.Validate)
+		NumberOfPlanes++;
+	if(Options.CirclesAlgorithm)
+		NumberOfPlanes++;
+	if(Options.ThinLinesAlgorithm)
+		NumberOfPlanes+=2;
+
+	Memory=NumberOfPlanes*NumberOfPixels;
+
+	// Scratch buffers every thread of a parallel image keeps until the image is done: the Otsu buffer of an
+	// expanded lines bin and the band, prefix and suffix buffers of the background running filters
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo(&SystemInfo);
+	unsigned long long NumberOfThreads=Options.Serial ? 1 : max(1u,(unsigned int)SystemInfo.dwNumberOfProcessors);
+	unsigned long long ThreadMemory=0;
+	if(Options.LinesAlgorithm) {
+		unsigned long long ExpandedBinSize=Options.BinSize+2*LinesRoiExpansion;
+		ThreadMemory+=ExpandedBinSize*ExpandedBinSize*InputPlanes;
+	}
+	if(Options.LinesAlgorithm && Options.BackgroundRadius) {
+		unsigned long long PaddedLength=max(ImageWidth,ImageHeight)+4ull*Options.BackgroundRadius+1;
+		ThreadMemory+=(ImageWidth+2*PaddedLength)*BackgroundStripWidth*InputPlanes;
+	}
+	Memory+=NumberOfThreads*ThreadMemory;
+
+	// ROI spans, the row offsets and a few spans per row
+	if(Options.Roi)
+		Memory+=(unsigned long long)(ImageHeight+1)*sizeof(unsigned int)+(unsigned long long)ImageHeight*4*2*sizeof(unsigned int);
+
+	Cost=(double)NumberOfPixels;
+
+	return true;
+}
+
+unsigned long long GetMemoryLimit() {
+
+	// A 32 bit process runs out of address space long before physical memory
+	MEMORYSTATUSEX MemoryStatus;
+	MemoryStatus.dwLength=sizeof(MemoryStatus);
+	if(!GlobalMemoryStatusEx(&MemoryStatus))
+		return 0;
+
+	return min(MemoryStatus.ullAvailPhys,MemoryStatus.ullAvailVirtual)/4*3;
+}
+
+bool RunScheduledBatch(const vector<string>& ImageFileNames, const ProcessingOptions& Options,
+					   map<unsigned int, map<string, double> >& MapResults) {
+
+	// Pinning the worker only places the buffers it touches itself. With Numa each image therefore runs its bins
+	// on the worker alone, not on the shared ConcRT scheduler, and the pool is off, since its buffers were first
+	// touched by whichever image released them, on any node
+	ProcessingOptions ImageOptions=Options;
+	if(Options.Numa) {
+		ImageOptions.Serial=true;
+		SetBufferPoolLimit(0);
+	}
+
+	// Estimate all images up front
+	unsigned int NumberOfImages=(unsigned int)ImageFileNames.size();
+	vector<unsigned long long> Memory(NumberOfImages,0);
+	vector<double> Cost(NumberOfImages,0.0);
+	vector<unsigned int> Order(NumberOfImages);
+	for(unsigned int Cnt1=0;Cnt1<NumberOfImages;Cnt1++) {
+		if(!EstimateImageNeeds(ImageFileNames[Cnt1],ImageOptions,Memory[Cnt1],Cost[Cnt1]))
+			printf("Failed to read header of image %s\n",ImageFileNames[Cnt1].c_str());
+		Order[Cnt1]=Cnt1;
+	}
+
+	// Keep headroom in physical memory and in the address space of this process
+	unsigned long long MemoryBudget=Options.MemoryBudget;
+	unsigned long long MemoryLimit=GetMemoryLimit();
+	if(MemoryLimit && (MemoryBudget > MemoryLimit)) {
+		printf("Memory budget of %llu MB exceeds the %llu MB available to this process, using %llu MB\n",MemoryBudget>>20,MemoryLimit>>20,MemoryLimit>>20);
+		MemoryBudget=MemoryLimit;
+	}
+
+	// Buffers the pool keeps after release are in no image's estimate, so its limit comes out of the budget.
+	// When that would leave less than half of the budget the pool is turned off instead
+	unsigned long long PoolLimit=GetBufferPoolLimit();
+	if(PoolLimit && (PoolLimit <= MemoryBudget/2)) {
+		MemoryBudget-=PoolLimit;
+	}
+	else if(PoolLimit) {
+		printf("Buffer pool of %llu MB does not fit in the memory budget, turning it off\n",PoolLimit>>20);
+		SetBufferPoolLimit(0);
+	}
+
+	// Largest images first, so no large image is left to run alone at the end
+	stable_sort(Order.begin(),Order.end(),[&](unsigned int A,unsigned int B) { return Cost[A] > Cost[B]; });
+
+	// More running images than processors only adds memory
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo(&SystemInfo);
+	unsigned int MaxRunning=max(1u,(unsigned int)SystemInfo.dwNumberOfProcessors);
+
+	// Processor masks of the NUMA nodes
+	vector<GROUP_AFFINITY> NodeAffinities;
+	if(Options.Numa) {
+		ULONG HighestNodeNumber=0;
+		if(GetNumaHighestNodeNumber(&HighestNodeNumber)) {
+			for(ULONG Cnt1=0;Cnt1<=HighestNodeNumber;Cnt1++) {
+				GROUP_AFFINITY Affinity;
+				memset(&Affinity,0,sizeof(Affinity));
+				if(GetNumaNodeProcessorMaskEx((USHORT)Cnt1,&Affinity) && Affinity.Mask)
+					NodeAffinities.push_back(Affinity);
+			}
+		}
+		if(NodeAffinities.empty())
+			printf("RunScheduledBatch found no NUMA nodes, workers are not pinned\n");
+	}
+	vector<unsigned long long> NodeMemory(NodeAffinities.size(),0);
+
+	printf("Scheduling %u images within %llu MB on up to %u workers and %u NUMA nodes\n",
+		   NumberOfImages,MemoryBudget>>20,MaxRunning,(unsigned int)NodeAffinities.size());
+
+	// Admission state, shared with the workers
+	mutex Mutex;
+	condition_variable Finished;
+	vector<bool> IsStarted(NumberOfImages,false);
+	vector<thread> Workers;
+	unsigned long long MemoryInUse=0;
+	unsigned int NumberOfRunning=0,NumberOfFinished=0,NumberOfFailed=0;
+
+	unique_lock<mutex> Lock(Mutex);
+	while(NumberOfFinished < NumberOfImages) {
+
+		// Start waiting images in order while they fit, an image above the budget only when nothing else runs.
+		// Smaller images never pass a blocked one, which would otherwise wait for them and run last
+		for(unsigned int Cnt1=0;(Cnt1<NumberOfImages) && (NumberOfRunning<MaxRunning);Cnt1++) {
+			unsigned int Index=Order[Cnt1];
+			if(IsStarted[Index])
+				continue;
+			if(NumberOfRunning && (MemoryInUse+Memory[Index] > MemoryBudget))
+				break;
+			if(Memory[Index] > MemoryBudget)
+				printf("Image %s needs about %llu MB, more than the memory budget, running it alone\n",ImageFileNames[Index].c_str(),Memory[Index]>>20);
+
+			// Place on the node with the least memory in use
+			int Node=-1;
+			for(unsigned int Cnt2=0;Cnt2<NodeMemory.size();Cnt2++) {
+				if((Node < 0) || (NodeMemory[Cnt2] < NodeMemory[Node]))
+					Node=Cnt2;
+			}
+			if(Node >= 0)
+				NodeMemory[Node]+=Memory[Index];
+
+			IsStarted[Index]=true;
+			MemoryInUse+=Memory[Index];
+			NumberOfRunning++;
+			Workers.push_back(thread([&,Index,Node]() {
+
+				// Buffers are first touched by this thread, so a pinned worker gets them from its node
+				if(Node >= 0)
+					SetThreadGroupAffinity(GetCurrentThread(),&NodeAffinities[Node],NULL);
+
+				map<string, double> ImageResults;
+				bool Status=ProcessImage(ImageFileNames[Index],ImageOptions,ImageResults);
+
+				lock_guard<mutex> WorkerLock(Mutex);
+				if(ImageResults.size())
+					MapResults[Index]=ImageResults;
+				if(!Status)
+					NumberOfFailed++;
+				MemoryInUse-=Memory[Index];
+				if(Node >= 0)
+					NodeMemory[Node]-=Memory[Index];
+				NumberOfRunning--;
+				NumberOfFinished++;
+				printf("Finished processing %u images out of %u\n",NumberOfFinished,NumberOfImages);
+				Finished.notify_one();
+			}));
+		}
+
+		// Wait for a running image to free its memory
+		Finished.wait(Lock);
+	}
+	Lock.unlock();
+
+	// Release worker threads
+	for(unsigned int Cnt1=0;Cnt1<Workers.size();Cnt1++)
+		Workers[Cnt1].join();
+
+	return !NumberOfFailed;
+}
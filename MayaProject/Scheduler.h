@@ -0,0 +1,27 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "MayaProject.h"
+
+// Estimated peak memory [Bytes] and cost [Pixels] of processing one image, from its TIFF header
+bool EstimateImageNeeds(const std::string& ImageFileName, const ProcessingOptions& Options, unsigned long long& Memory, double& Cost);
+
+// Memory [Bytes] the batch may use, three quarters of the smaller of the free physical memory and the free
+// address space of this process, 0 when it can not be queried
+unsigned long long GetMemoryLimit();
+
+// Processes several images at once, strictly largest first, admitting the next image only while the estimated
+// memory of all running images stays within Options.MemoryBudget, clamped to GetMemoryLimit. An image larger
+// than the budget runs alone. The buffer pool limit is taken out of the budget, or the pool is turned off when
+// it exceeds half of it.
+// With Options.Numa each image runs on a thread pinned to the NUMA node with the least memory in use, so
+// its buffers are allocated on that node. The image is then processed serially on that thread, as the parallel
+// loops would run on the shared unpinned scheduler, and the buffer pool is turned off, as its buffers may come
+// from another node. Numa trades parallelism within an image for locality across images. Results are keyed by index into ImageFileNames
+bool RunScheduledBatch(const std::vector<std::string>& ImageFileNames, const ProcessingOptions& Options,
+					   std::map<unsigned int, std::map<std::string, double> >& MapResults);
+
+#endif
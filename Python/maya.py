@@ -0,0 +1,146 @@
+"""Python bindings for MayaApi.dll.
+
+Images are 2-D uint8 or uint16 NumPy arrays (16 bit data is analysed at full
+depth; masks are always uint8). Any positive row stride is passed to the
+native code as the byte step, so crops and padded buffers are used in place;
+only arrays whose pixels are not contiguous within a row are copied. Calls go
+through ctypes, which releases the GIL for the duration of each native call,
+so the functions below can be driven from a thread pool. Result masks are
+returned as arrays that wrap the native buffers and free them
+when the last reference goes away.
+
+MayaApi.dll is built for Win32 only, so the bindings need a 32-bit CPython.
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+_DLL_PATH = os.environ.get(
+    "MAYA_API_DLL",
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "Release", "MayaApi.dll"))
+
+if ctypes.sizeof(ctypes.c_void_p) != 4:
+    raise ImportError("MayaApi.dll is a 32-bit (Win32) DLL and needs a 32-bit Python, this one is %d-bit"
+                      % (8 * ctypes.sizeof(ctypes.c_void_p)))
+
+_lib = ctypes.CDLL(_DLL_PATH)
+
+_uint = ctypes.c_uint
+
+_lib.MayaInit.argtypes = []
+_lib.MayaInit.restype = None
+_lib.MayaFree.argtypes = [ctypes.c_void_p]
+_lib.MayaFree.restype = None
+_lib.MayaReadImageTIF.argtypes = [ctypes.c_char_p, ctypes.POINTER(_uint), ctypes.POINTER(_uint),
+                                  ctypes.POINTER(ctypes.c_int)]
+_lib.MayaReadImageTIF.restype = ctypes.c_void_p
+_lib.MayaCalculateLines.argtypes = [ctypes.c_void_p, _uint, _uint, _uint, ctypes.POINTER(ctypes.c_double),
+                                    ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_int)]
+_lib.MayaCalculateLines.restype = ctypes.c_int
+_lib.MayaReadImageTIF16.argtypes = _lib.MayaReadImageTIF.argtypes
+_lib.MayaReadImageTIF16.restype = ctypes.c_void_p
+_lib.MayaCalculateLines16.argtypes = _lib.MayaCalculateLines.argtypes
+_lib.MayaCalculateLines16.restype = ctypes.c_int
+_lib.MayaCalculateCircles.argtypes = [ctypes.c_void_p, _uint, _uint, _uint, ctypes.c_void_p, _uint,
+                                      ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_void_p),
+                                      ctypes.POINTER(ctypes.c_int)]
+_lib.MayaCalculateCircles.restype = ctypes.c_int
+_lib.MayaCalculateCircles16.argtypes = _lib.MayaCalculateCircles.argtypes
+_lib.MayaCalculateCircles16.restype = ctypes.c_int
+_lib.MayaCalculateThinLines.argtypes = [ctypes.c_void_p, _uint, _uint, _uint, ctypes.POINTER(ctypes.c_double)]
+_lib.MayaCalculateThinLines.restype = ctypes.c_int
+
+_lib.MayaInit()
+
+
+class _NativeImage(object):
+    """Owner of a native buffer, exposed to NumPy via __array_interface__."""
+
+    def __init__(self, pointer, width, height, byte_step, dtype):
+        self._pointer = pointer
+        self.__array_interface__ = {
+            "shape": (height, width),
+            "typestr": dtype.str,
+            "data": (pointer, False),
+            "strides": (byte_step, dtype.itemsize),
+            "version": 3,
+        }
+
+    def __del__(self):
+        if self._pointer:
+            _lib.MayaFree(self._pointer)
+            self._pointer = None
+
+
+def _wrap(pointer, width, height, byte_step, dtype=np.dtype(np.uint8)):
+    # The returned array keeps the owner alive through its .base chain
+    return np.asarray(_NativeImage(pointer, width, height, byte_step, dtype))
+
+
+def _as_image(image, writeable=False, dtypes=(np.uint8,)):
+    image = np.asarray(image)
+    if image.ndim != 2 or image.dtype not in dtypes:
+        raise ValueError("expected a 2-D %s array, got %s %s" % (
+            " or ".join(np.dtype(d).name for d in dtypes), image.ndim, image.dtype))
+    if image.strides[1] != image.itemsize or image.strides[0] < image.shape[1] * image.itemsize:
+        if writeable:
+            raise ValueError("in-place input must have unit pixel stride and a positive row stride")
+        image = np.ascontiguousarray(image)
+    if writeable and not image.flags.writeable:
+        raise ValueError("in-place input must be writeable")
+    return image
+
+
+def read_image_tif(file_name, native16=False):
+    """Read a TIFF into a native buffer. Returns uint8, or uint16 for 16 bit
+    gray images when native16 is set."""
+    width, height, byte_step = _uint(), _uint(), ctypes.c_int()
+    if native16:
+        read, dtype = _lib.MayaReadImageTIF16, np.dtype(np.uint16)
+    else:
+        read, dtype = _lib.MayaReadImageTIF, np.dtype(np.uint8)
+    pointer = read(os.fsencode(file_name), ctypes.byref(width), ctypes.byref(height), ctypes.byref(byte_step))
+    if not pointer:
+        raise IOError("failed to read %s" % file_name)
+    return _wrap(pointer, width.value, height.value, byte_step.value, dtype)
+
+
+def calculate_lines(image):
+    """Return (lines percentage, lines mask)."""
+    image = _as_image(image, dtypes=(np.uint8, np.uint16))
+    height, width = image.shape
+    result, mask, mask_step = ctypes.c_double(), ctypes.c_void_p(), ctypes.c_int()
+    calculate = _lib.MayaCalculateLines16 if image.dtype == np.uint16 else _lib.MayaCalculateLines
+    if not calculate(image.ctypes.data, width, height, image.strides[0], ctypes.byref(result),
+                     ctypes.byref(mask), ctypes.byref(mask_step)):
+        raise RuntimeError("CalculateLines failed")
+    return result.value, _wrap(mask.value, width, height, mask_step.value)
+
+
+def calculate_circles(image, lines_mask):
+    """Return (circles ratio, circles mask) for an image and its lines mask."""
+    image = _as_image(image, dtypes=(np.uint8, np.uint16))
+    lines_mask = _as_image(lines_mask)
+    if image.shape != lines_mask.shape:
+        raise ValueError("image and lines mask must have the same shape")
+    height, width = image.shape
+    result, mask, mask_step = ctypes.c_double(), ctypes.c_void_p(), ctypes.c_int()
+    calculate = _lib.MayaCalculateCircles16 if image.dtype == np.uint16 else _lib.MayaCalculateCircles
+    if not calculate(image.ctypes.data, width, height, image.strides[0], lines_mask.ctypes.data,
+                     lines_mask.strides[0], ctypes.byref(result), ctypes.byref(mask), ctypes.byref(mask_step)):
+        raise RuntimeError("CalculateCircles failed")
+    return result.value, _wrap(mask.value, width, height, mask_step.value)
+
+
+def calculate_thin_lines(lines_mask):
+    """Return the thin lines percentage. As in the executable, the lines mask is
+    reduced to its thin lines in place."""
+    lines_mask = _as_image(lines_mask, writeable=True)
+    height, width = lines_mask.shape
+    result = ctypes.c_double()
+    if not _lib.MayaCalculateThinLines(lines_mask.ctypes.data, lines_mask.strides[0], width, height,
+                                       ctypes.byref(result)):
+        raise RuntimeError("CalculateThinLines failed")
+    return result.value
@@ -0,0 +1,67 @@
+"""Reader for the per bin grid files written by MayaProject.exe with SaveGrid.
+
+Each <image>_G.grid file holds one record per bin of the lines algorithm: the
+final Otsu threshold, the mean and std of the background below it, the fraction
+of the bin in the lines mask and the number of circle pixels. Bins are square,
+their side is set with BinSize= (64 by default) and stored in the header, where
+Grid.bin_size reads it.
+Files are read with a single np.fromfile call, so whole batches load quickly.
+"""
+
+import glob
+import os
+
+import numpy as np
+
+HEADER_DTYPE = np.dtype([("magic", "S8"), ("version", "<u4"), ("flags", "<u4"), ("width", "<u4"),
+                         ("height", "<u4"), ("bin_size", "<u4"), ("bins_x", "<u4"), ("bins_y", "<u4")])
+BIN_DTYPE = np.dtype([("threshold", "<f4"), ("background_mean", "<f4"), ("background_std", "<f4"),
+                      ("foreground_fraction", "<f4"), ("circles", "<u4")])
+HAS_CIRCLES = 1
+
+
+class Grid(object):
+    """Bins of one image. bins is a (bins_y, bins_x) structured array of BIN_DTYPE."""
+
+    def __init__(self, file_name, header, bins):
+        self.file_name = file_name
+        self.width = int(header["width"])
+        self.height = int(header["height"])
+        self.bin_size = int(header["bin_size"])
+        self.has_circles = bool(header["flags"] & HAS_CIRCLES)
+        self.bins = bins
+
+    def __getitem__(self, field):
+        return self.bins[field]
+
+
+def read_grid(file_name):
+    """Read one grid file."""
+    data = np.fromfile(file_name, dtype=np.uint8)
+    if data.size < HEADER_DTYPE.itemsize:
+        raise IOError("%s is too short for a grid file" % file_name)
+    header = data[:HEADER_DTYPE.itemsize].view(HEADER_DTYPE)[0]
+    if header["magic"] != b"MAYAGRID" or header["version"] != 1:
+        raise IOError("%s is not a grid file" % file_name)
+    shape = (int(header["bins_y"]), int(header["bins_x"]))
+    bins = data[HEADER_DTYPE.itemsize:].view(BIN_DTYPE)
+    if bins.size != shape[0] * shape[1]:
+        raise IOError("%s holds %d bins instead of %d" % (file_name, bins.size, shape[0] * shape[1]))
+    return Grid(file_name, header, bins.reshape(shape))
+
+
+def read_grids(root):
+    """Read all grid files under a directory, sorted by file name."""
+    file_names = sorted(glob.glob(os.path.join(root, "**", "*_G.grid"), recursive=True))
+    return [read_grid(file_name) for file_name in file_names]
+
+
+def stack(grids, field):
+    """Stack one field of several grids into a (len(grids), bins_y, bins_x) float array,
+    padding smaller grids with NaN, for batch statistics with np.nanmean and friends."""
+    bins_y = max(grid.bins.shape[0] for grid in grids)
+    bins_x = max(grid.bins.shape[1] for grid in grids)
+    result = np.full((len(grids), bins_y, bins_x), np.nan)
+    for index, grid in enumerate(grids):
+        result[index, :grid.bins.shape[0], :grid.bins.shape[1]] = grid[field]
+    return result